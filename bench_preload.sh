@@ -0,0 +1,36 @@
+#!/bin/bash
+
+# Times a few ordinary programs with the system allocator and with
+# libsimplemalloc.so preloaded. Usage: ./bench_preload.sh [runs]
+
+runs=${1:-5}
+lib="$(pwd)/libsimplemalloc.so"
+tmp=$(mktemp)
+trap 'rm -f "$tmp"' EXIT
+
+seq 1 20000 | shuf --random-source=<(yes) > "$tmp"
+
+progs=(
+  "sort $tmp"
+  "sort -n $tmp"
+  "ls -lR /usr/include"
+  "awk {s+=\$1}END{print(s)} $tmp"
+  "gzip -c $tmp"
+)
+
+run() {
+  local start end i
+  start=$(date +%s%N)
+  for ((i = 0; i < runs; i++)); do
+    env "$@" > /dev/null 2>&1 || return 1
+  done
+  end=$(date +%s%N)
+  echo $(( (end - start) / runs / 1000 ))
+}
+
+printf "%-32s %12s %12s\n" "program" "libc (us)" "simple (us)"
+for p in "${progs[@]}"; do
+  base=$(run $p)
+  shim=$(run LD_PRELOAD="$lib" $p) || shim="failed"
+  printf "%-32s %12s %12s\n" "${p/$tmp/input}" "$base" "$shim"
+done
@@ -0,0 +1,342 @@
+
+/**
+ * @file   cmd_bench.c
+ * @brief  End-to-end benchmark of the command interpreter.
+ *
+ *   cmd_bench [-n COMMANDS] [-s SEED] [-m MIX] [-b BINARY] [-a ARG]
+ *
+ * Generates a command stream of COMMANDS commands (default 1000000) for each
+ * mix (append, remove, print, random, or all of them, the default) and runs it
+ *
+ *   in-process  through interp_run() directly, output counted but not written
+ *   binary      through BINARY (default ./cmd_int, with ARG if given, e.g. -a -p)
+ *               with the stream as a file on stdin and stdout read by a pipe
+ *
+ * Every run is a process of its own, so the arena starts empty and the peak
+ * memory (maximum resident set) belongs to the run. Reported per run: commands/s,
+ * allocator calls per command (counted by wrapping simple_malloc/simple_free
+ * in-process, and from the allocator trace for the binary, so 0 if it was built
+ * with MM_SILENT), read/write system calls per command (/proc/PID/io), peak memory
+ * and output size.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "io.h"
+#include "mm.h"
+#include "scan.h"
+#include "interp.h"
+
+/* Percentages of a, b, c and newline commands */
+struct mix {
+  const char* name;
+  int a, b, c, newline;
+};
+
+static const struct mix mixes[] = {
+  { "append", 85, 10,  4,  1 },
+  { "remove", 30, 10, 55,  5 },
+  { "print",  35,  5, 35, 25 },
+  { "random", 25, 25, 25, 25 },
+};
+
+#define MIXES (sizeof(mixes) / sizeof(mixes[0]))
+
+struct result {
+  double seconds;
+  unsigned long allocs;
+  unsigned long frees;
+  unsigned long output;
+  unsigned long syscalls;
+  long peak_kb;
+};
+
+/* Allocator calls of the in-process run; the linker routes simple_malloc/simple_free here */
+void* __real_simple_malloc(size_t size);
+void __real_simple_free(void* ptr);
+
+static unsigned long malloc_calls = 0;
+static unsigned long free_calls = 0;
+static unsigned long output_bytes = 0;
+
+void* __wrap_simple_malloc(size_t size) {
+  malloc_calls++;
+  return __real_simple_malloc(size);
+}
+
+void __wrap_simple_free(void* ptr) {
+  free_calls++;
+  __real_simple_free(ptr);
+}
+
+static void
+count_output(void* arg, const char* p, size_t n) {
+  output_bytes += n;
+}
+
+static double
+now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Fills stream with n commands drawn from mix */
+static void
+generate(char* stream, size_t n, const struct mix* mix, unsigned long seed) {
+  unsigned long state = seed * 0x9E3779B97F4A7C15UL + 1;
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    unsigned r;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    r = state % 100;
+    stream[i] = r < (unsigned)mix->a ? 'a'
+              : r < (unsigned)(mix->a + mix->b) ? 'b'
+              : r < (unsigned)(mix->a + mix->b + mix->c) ? 'c' : '\n';
+  }
+}
+
+/* Read and write system calls of a finished (not yet reaped) child */
+static unsigned long
+child_syscalls(pid_t pid) {
+  char path[64];
+  char buf[512];
+  unsigned long total = 0;
+  const char* names[] = { "syscr: ", "syscw: " };
+  ssize_t len;
+  int fd;
+  int i;
+
+  memcpy(path, "/proc/", 6);
+  path[6 + format_long(path + 6, pid)] = '\0';
+  strcat(path, "/io");
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return 0;
+  buf[len] = '\0';
+  for (i = 0; i < 2; i++) {
+    const char* p = strstr(buf, names[i]);
+    if (p) total += strtoul(p + strlen(names[i]), NULL, 10);
+  }
+  return total;
+}
+
+/* Waits for pid, filling in its system calls and peak memory */
+static int
+reap(pid_t pid, struct result* r) {
+  struct rusage usage;
+  siginfo_t info;
+  int status;
+
+  if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) != 0) return -1;
+  r->syscalls = child_syscalls(pid);
+  if (wait4(pid, &status, 0, &usage) != pid) return -1;
+  r->peak_kb = usage.ru_maxrss;
+  return 0;
+}
+
+/* Runs the stream on the interpreter in a child process */
+static int
+run_in_process(const char* stream, size_t n, struct result* r) {
+  int fds[2];
+  pid_t pid;
+
+  if (pipe(fds) != 0) return -1;
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    Interpreter interp = INTERPRETER_INIT;
+    const char* end = stream + n;
+    const char* p = stream;
+    struct result child;
+    double start;
+    size_t run;
+    int running = 1;
+
+    close(fds[0]);
+    set_output_sink(count_output, NULL);
+    start = now();
+    for (; p < end && running; p += run) {
+      run = command_run(p, end);
+      running = interp_run(&interp, *p, run);
+    }
+    interp_finish(&interp);
+    memset(&child, 0, sizeof(child));
+    child.seconds = now() - start;
+    child.allocs = malloc_calls;
+    child.frees = free_calls;
+    child.output = output_bytes;
+    _exit(write(fds[1], &child, sizeof(child)) == sizeof(child) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], r, sizeof(*r)) != sizeof(*r)) {
+    close(fds[0]);
+    reap(pid, r);
+    return -1;
+  }
+  close(fds[0]);
+  return reap(pid, r);
+}
+
+/* Counts allocator trace lines in a block of the binary's output. carry holds the start
+ * of a line cut off at the end of the previous block */
+static void
+count_trace(const char* p, size_t len, char* carry, size_t* carry_len, struct result* r) {
+  const char* end = p + len;
+
+  while (p < end) {
+    const char* nl = memchr(p, '\n', end - p);
+    size_t k = (nl ? nl : end) - p;
+
+    // Only the first bytes of a line are needed to classify it
+    if (*carry_len < 64) {
+      size_t copy = k < 64 - *carry_len ? k : 64 - *carry_len;
+      memcpy(carry + *carry_len, p, copy);
+      *carry_len += copy;
+    }
+    if (nl == NULL) break;
+    carry[*carry_len] = '\0';
+    if (strncmp(carry, "Allocating ", 11) == 0 && strstr(carry, " bytes at 0x") != NULL) {
+      r->allocs++;
+    } else if (strncmp(carry, "Freeing block at 0x", 19) == 0 && strstr(carry, "merging") == NULL) {
+      r->frees++;
+    }
+    *carry_len = 0;
+    p = nl + 1;
+  }
+}
+
+/* Runs the binary with the stream file on stdin */
+static int
+run_binary(const char* binary, const char* arg, const char* input, struct result* r) {
+  static char buf[1 << 16];
+  char carry[65];
+  size_t carry_len = 0;
+  int fds[2];
+  double start;
+  ssize_t len;
+  pid_t pid;
+
+  if (pipe(fds) != 0) return -1;
+  start = now();
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    int in = open(input, O_RDONLY);
+    if (in < 0) _exit(127);
+    dup2(in, 0);
+    dup2(fds[1], 1);
+    close(fds[0]);
+    close(fds[1]);
+    close(in);
+    execl(binary, binary, arg, (char*)NULL);
+    _exit(127);
+  }
+
+  close(fds[1]);
+  memset(r, 0, sizeof(*r));
+  while ((len = read(fds[0], buf, sizeof(buf))) != 0) {
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    r->output += len;
+    count_trace(buf, len, carry, &carry_len, r);
+  }
+  close(fds[0]);
+  if (reap(pid, r) != 0) return -1;
+  r->seconds = now() - start;
+  return 0;
+}
+
+static void
+report(const char* mix, const char* mode, size_t n, const struct result* r) {
+  write_fmt("%8s %10s %12lu %12lu.%03lu %12lu.%03lu %10ld %10lu\n", mix, mode,
+            (unsigned long)(n / r->seconds),
+            (r->allocs + r->frees) / n, (r->allocs + r->frees) * 1000 / n % 1000,
+            r->syscalls / n, r->syscalls * 1000 / n % 1000,
+            r->peak_kb, r->output >> 20);
+  flush_output();
+}
+
+int
+main(int argc, char** argv) {
+  const char* binary = "./cmd_int";
+  const char* binary_arg = NULL;
+  const char* only = "all";
+  unsigned long seed = 1;
+  size_t n = 1000000;
+  char input[] = "/tmp/cmd_bench.XXXXXX";
+  char* stream;
+  size_t m;
+  int opt;
+  int fd;
+
+  while ((opt = getopt(argc, argv, "n:s:m:b:a:")) != -1) {
+    switch (opt) {
+    case 'n': n = strtoul(optarg, NULL, 10); break;
+    case 's': seed = strtoul(optarg, NULL, 10); break;
+    case 'm': only = optarg; break;
+    case 'b': binary = optarg; break;
+    case 'a': binary_arg = optarg; break;
+    default:
+      write_string("Usage: cmd_bench [-n COMMANDS] [-s SEED] [-m append|remove|print|random|all] [-b BINARY] [-a ARG]\n");
+      return 2;
+    }
+  }
+  if (n == 0) n = 1;
+
+  stream = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  fd = mkstemp(input);
+  if (stream == MAP_FAILED || fd < 0) {
+    write_string("Cannot set up the command stream\n");
+    return 1;
+  }
+
+  write_fmt("%lu commands, seed %lu, binary %s%s%s\n", (unsigned long)n, seed, binary,
+            binary_arg ? " " : "", binary_arg ? binary_arg : "");
+  write_fmt("%8s %10s %12s %16s %16s %10s %10s\n", "mix", "mode", "commands/s",
+            "alloc calls/cmd", "syscalls/cmd", "peak KB", "output MB");
+
+  for (m = 0; m < MIXES; m++) {
+    struct result r;
+
+    if (strcmp(only, "all") != 0 && strcmp(only, mixes[m].name) != 0) continue;
+    generate(stream, n, &mixes[m], seed);
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, stream, n, 0) != (ssize_t)n) {
+      write_string("Cannot write the command stream\n");
+      break;
+    }
+
+    memset(&r, 0, sizeof(r));
+    if (run_in_process(stream, n, &r) == 0) {
+      report(mixes[m].name, "in-process", n, &r);
+    } else {
+      write_fmt("%8s %10s failed\n", mixes[m].name, "in-process");
+    }
+    if (run_binary(binary, binary_arg, input, &r) == 0) {
+      report(mixes[m].name, "binary", n, &r);
+    } else {
+      write_fmt("%8s %10s failed\n", mixes[m].name, "binary");
+    }
+  }
+
+  close(fd);
+  unlink(input);
+  return 0;
+}
@@ -0,0 +1,230 @@
+
+/**
+ * @file   cmd_load.c
+ * @brief  Load generator for the server mode of cmd_int (cmd_int -s PATH).
+ *
+ *   cmd_load PATH [CLIENTS [SESSIONS [COMMANDS [SEED [DELAY]]]]]
+ *
+ * Starts CLIENTS threads that each run SESSIONS sessions one after another. A
+ * session connects, sends COMMANDS random commands (a, b, c and a newline now and
+ * then), shuts down its side and reads the output until the server closes the
+ * connection. The final collection in the output is checked against a local
+ * simulation of the commands. Prints sessions/s, commands/s, bytes received and
+ * the number of failed sessions. With DELAY, the clients wait DELAY ms before every
+ * read, to act as slow readers of a server that produces output faster than that.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "io.h"
+
+#define MAX_CLIENTS 256
+#define TAIL_SIZE   (64 * 1024)       // Output kept for the check at the end
+
+static const char* socket_path;
+static int sessions_per_client = 100;
+static int commands_per_session = 1000;
+static unsigned long seed = 1;
+static int read_delay = 0;            // ms before every read
+
+struct client {
+  pthread_t thread;
+  int id;
+  unsigned long sessions;
+  unsigned long failed;
+  unsigned long received;
+  char* commands;                     // Command stream and the expected closing lines
+  char* expected;
+  int* values;                        // Simulated collection
+  size_t expected_len;
+  char tail[TAIL_SIZE];
+  size_t tail_len;
+};
+
+static struct client clients[MAX_CLIENTS];
+
+static unsigned long
+next_random(unsigned long* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/* Fills in a random command stream and the collection line it must end with */
+static void
+make_session(struct client* c, unsigned long* state) {
+  static const char mix[] = "aaaabbbcc\n";
+  int* values = c->values;
+  size_t count = 0;
+  int counter = 0;
+  size_t len = 0;
+  size_t i;
+
+  for (i = 0; i < (size_t)commands_per_session; i++) {
+    char cmd = mix[next_random(state) % (sizeof(mix) - 1)];
+    c->commands[i] = cmd;
+    if (cmd == 'a') {
+      values[count++] = counter++;
+    } else if (cmd == 'b') {
+      counter++;
+    } else if (cmd == 'c' && count > 0) {
+      count--;
+    }
+  }
+
+  memcpy(c->expected, "Invalid input. Exiting...\n", 26);
+  len = 26;
+  for (i = 0; i < count; i++) {
+    if (i > 0) c->expected[len++] = ',';
+    len += format_long(c->expected + len, values[i]);
+  }
+  c->expected[len++] = ';';
+  c->expected[len++] = '\n';
+  c->expected_len = len;
+}
+
+/* Keeps the last TAIL_SIZE / 2 to TAIL_SIZE bytes of the output */
+static void
+keep_tail(struct client* c, const char* p, size_t n) {
+  if (n >= TAIL_SIZE / 2) {
+    p += n - TAIL_SIZE / 2;
+    n = TAIL_SIZE / 2;
+  }
+  if (c->tail_len + n > TAIL_SIZE) {
+    memmove(c->tail, c->tail + c->tail_len - TAIL_SIZE / 2, TAIL_SIZE / 2);
+    c->tail_len = TAIL_SIZE / 2;
+  }
+  memcpy(c->tail + c->tail_len, p, n);
+  c->tail_len += n;
+}
+
+/* Runs one session. Returns 0 if the output ends as expected */
+static int
+run_session(struct client* c) {
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+  size_t sent = 0;
+  char buf[64 * 1024];
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    if (fd >= 0) close(fd);
+    return -1;
+  }
+
+  // Send and receive at the same time, or a large output could block both sides
+  c->tail_len = 0;
+  pfd.fd = fd;
+  for (;;) {
+    ssize_t n;
+
+    pfd.events = POLLIN | (sent < (size_t)commands_per_session ? POLLOUT : 0);
+    if (poll(&pfd, 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (pfd.revents & POLLOUT) {
+      n = send(fd, c->commands + sent, commands_per_session - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (n > 0) sent += n;
+      if (sent == (size_t)commands_per_session) shutdown(fd, SHUT_WR);
+    }
+    if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (read_delay > 0) usleep(read_delay * 1000);
+      n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n == 0) break;
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) continue;
+        break;
+      }
+      c->received += n;
+      keep_tail(c, buf, n);
+    }
+  }
+  close(fd);
+
+  // The closing lines are followed only by allocator trace, if any
+  if (c->tail_len < c->expected_len) return -1;
+  return memmem(c->tail, c->tail_len, c->expected, c->expected_len) != NULL ? 0 : -1;
+}
+
+static void*
+client_main(void* arg) {
+  struct client* c = arg;
+  unsigned long state = seed * 0x9E3779B97F4A7C15UL + c->id + 1;
+  int i;
+
+  for (i = 0; i < sessions_per_client; i++) {
+    make_session(c, &state);
+    if (run_session(c) != 0) c->failed++;
+    c->sessions++;
+  }
+  return NULL;
+}
+
+int
+main(int argc, char** argv) {
+  struct timespec start, end;
+  unsigned long sessions = 0, failed = 0, received = 0;
+  double seconds;
+  int n_clients = 4;
+  int i;
+
+  if (argc < 2) {
+    write_string("Usage: cmd_load PATH [CLIENTS [SESSIONS [COMMANDS [SEED [DELAY]]]]]\n");
+    return 2;
+  }
+  socket_path = argv[1];
+  if (argc > 2) n_clients = atoi(argv[2]);
+  if (argc > 3) sessions_per_client = atoi(argv[3]);
+  if (argc > 4) commands_per_session = atoi(argv[4]);
+  if (argc > 5) seed = strtoul(argv[5], NULL, 10);
+  if (argc > 6) read_delay = atoi(argv[6]);
+  if (n_clients < 1) n_clients = 1;
+  if (n_clients > MAX_CLIENTS) n_clients = MAX_CLIENTS;
+  if (commands_per_session < 1) commands_per_session = 1;
+
+  for (i = 0; i < n_clients; i++) {
+    clients[i].id = i;
+    clients[i].commands = malloc(commands_per_session);
+    clients[i].expected = malloc(12 * (size_t)commands_per_session + 32);
+    clients[i].values = malloc(sizeof(int) * (size_t)commands_per_session);
+    if (clients[i].commands == NULL || clients[i].expected == NULL || clients[i].values == NULL) {
+      write_string("Out of memory\n");
+      return 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < n_clients; i++) {
+    pthread_create(&clients[i].thread, NULL, client_main, &clients[i]);
+  }
+  for (i = 0; i < n_clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    sessions += clients[i].sessions;
+    failed += clients[i].failed;
+    received += clients[i].received;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  write_fmt("%lu sessions by %d clients in %lu ms\n", sessions, n_clients, (unsigned long)(seconds * 1000));
+  write_fmt("%lu sessions/s, %lu commands/s, %lu bytes received\n",
+            (unsigned long)(sessions / seconds),
+            (unsigned long)(sessions * commands_per_session / seconds), received);
+  write_fmt("%lu failed\n", failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+
+#define _GNU_SOURCE
+
+/* You are not allowed to use <stdio.h> */
+#include "io.h"
+#include "mm.h"
+#include "collection.h"
+#include <string.h>
+#include <sys/mman.h>
+
+/* Room for a comma, an int, and the ";\n" written after the text when printing */
+#define TEXT_RESERVE 16
+#define TEXT_INITIAL_SIZE 4096
+
+/* Makes room for TEXT_RESERVE more chars of text, doubling the buffer as needed. Returns 0 or -1 */
+static int reserve_text(Collection* collection) {
+    size_t size = collection->text_size ? collection->text_size : TEXT_INITIAL_SIZE;
+    char* text;
+
+    if (collection->text_len + TEXT_RESERVE <= collection->text_size) {
+        return 0;
+    }
+    while (collection->text_len + TEXT_RESERVE > size) {
+        size *= 2;
+    }
+    text = (char*)simple_malloc(size);
+    if (!text) {
+        return -1;
+    }
+    if (collection->text) {
+        if (!collection->text_deferred) {
+            memcpy(text, collection->text, collection->text_len);
+        }
+        simple_free(collection->text);
+    }
+    collection->text = text;
+    collection->text_size = size;
+    return 0;
+}
+
+/* Length of the printed form of value */
+static size_t text_length(int value) {
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+    size_t len = value < 0 ? 2 : 1;
+
+    while (magnitude >= 10) {
+        magnitude /= 10;
+        len++;
+    }
+    return len;
+}
+
+/* Function that can add a new element to the end of the collection */
+int* add_element_to_collection(Collection* collection, int value) {
+    Chunk* tail = collection->tail;
+    size_t start = collection->text_len;
+
+    if (reserve_text(collection) != 0) {
+        // Memory allocation error handling
+        return NULL;
+    }
+    if (!tail || tail->count == CHUNK_VALUES) {
+        // The tail chunk is full, start a new one
+        Chunk* new_chunk = collection->spare;
+        if (new_chunk) {
+            collection->spare = NULL;
+        } else {
+            // Allocate memory using simple_malloc
+            new_chunk = (Chunk*)simple_malloc(CHUNK_SIZE);
+            if (!new_chunk) {
+                // Memory allocation error handling
+                return NULL;
+            }
+        }
+        new_chunk->count = 0;
+        new_chunk->next = NULL;
+        new_chunk->prev = tail;
+
+        // Add the chunk to the end of the list
+        if (tail) {
+            tail->next = new_chunk;
+        } else {
+            // If the list turns out to be empty, then we add the chunk as the head of the list
+            collection->head = new_chunk;
+        }
+        collection->tail = tail = new_chunk;
+    }
+    tail->text_start[tail->count] = start;
+    tail->values[tail->count++] = value;
+    if (collection->text_deferred) {
+        collection->text_len += (start > 0) + text_length(value);
+    } else {
+        if (start > 0) {
+            collection->text[collection->text_len++] = ',';
+        }
+        collection->text_len += format_long(collection->text + collection->text_len, value);
+    }
+    return &tail->values[tail->count - 1];
+}
+
+
+
+/* Function to remove the most recently added element from the collection */
+void remove_last_added_element(Collection* collection) {
+    Chunk* tail = collection->tail;
+
+    // If the collection is empty, there is nothing to remove
+    if (!tail) {
+        return;
+    }
+    collection->text_len = tail->text_start[--tail->count];
+    if (tail->count > 0) {
+        return;
+    }
+
+    // The tail chunk is empty, unlink it
+    collection->tail = tail->prev;
+    if (tail->prev) {
+        tail->prev->next = NULL;
+    } else {
+        collection->head = NULL;
+    }
+    if (collection->spare) {
+        simple_free(collection->spare);  // Use simple_free instead of free
+    }
+    collection->spare = tail;
+}
+
+
+
+/* Writes the printed form text of len chars and the terminator */
+static void write_text(char* text, size_t len) {
+    if (!text) {
+        // Call to functions from io.h
+        write_char(';');
+        write_char('\n');
+        return;
+    }
+
+    // The text always has room for the terminator, so the whole line is one write
+    text[len] = ';';
+    text[len + 1] = '\n';
+    write_bytes(text, len + 2);
+}
+
+/* Function meant to print the entire collection with appropriate separators and commas */
+void print_collection(Collection* collection) {
+    write_text(collection->text, collection->text_len);
+}
+
+
+
+/* Function to return all chunks of the collection to the allocator */
+void free_collection(Collection* collection) {
+    Chunk* chunk = collection->head;
+
+    while (chunk) {
+        Chunk* next = chunk->next;
+        simple_free(chunk);  // Use simple_free instead of free
+        chunk = next;
+    }
+    if (collection->spare) {
+        simple_free(collection->spare);
+    }
+    if (collection->text) {
+        simple_free(collection->text);
+    }
+    collection->head = collection->tail = collection->spare = NULL;
+    collection->text = NULL;
+    collection->text_len = collection->text_size = 0;
+}
+
+
+
+/* Grows the mapping at *p from *size to at least need bytes, doubling. Returns 0 or -1 */
+static int grow_mapping(void** p, size_t* size, size_t need, size_t initial) {
+    size_t new_size = *size ? *size : initial;
+    void* q;
+
+    while (need > new_size) {
+        new_size *= 2;
+    }
+    if (*p) {
+        q = mremap(*p, *size, new_size, MREMAP_MAYMOVE);
+    } else {
+        q = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (q == MAP_FAILED) {
+        return -1;
+    }
+    *p = q;
+    *size = new_size;
+    return 0;
+}
+
+/* Appends the text of value, unless there is no memory for it */
+void append_to_text(CollectionText* text, int value) {
+    if (text->text_len + TEXT_RESERVE > text->text_size &&
+        grow_mapping((void**)&text->text, &text->text_size, text->text_len + TEXT_RESERVE, TEXT_INITIAL_SIZE) != 0) {
+        return;
+    }
+    if ((text->count + 1) * sizeof(unsigned int) > text->starts_size &&
+        grow_mapping((void**)&text->starts, &text->starts_size, (text->count + 1) * sizeof(unsigned int), TEXT_INITIAL_SIZE) != 0) {
+        return;
+    }
+    text->starts[text->count++] = text->text_len;
+    if (text->text_len > 0) {
+        text->text[text->text_len++] = ',';
+    }
+    text->text_len += format_long(text->text + text->text_len, value);
+}
+
+/* Cuts off the text of the last value, if any */
+void remove_last_from_text(CollectionText* text) {
+    if (text->count > 0) {
+        text->text_len = text->starts[--text->count];
+    }
+}
+
+/* Writes the text like print_collection() */
+void print_text(CollectionText* text) {
+    write_text(text->text, text->text_len);
+}
+
+void free_text(CollectionText* text) {
+    if (text->text) {
+        munmap(text->text, text->text_size);
+    }
+    if (text->starts) {
+        munmap(text->starts, text->starts_size);
+    }
+    text->text = NULL;
+    text->starts = NULL;
+    text->text_len = text->text_size = text->count = text->starts_size = 0;
+}
@@ -0,0 +1,83 @@
+
+#ifndef COLLECTION_H_
+#define COLLECTION_H_
+
+#include <stddef.h>
+
+/* The collection is an unrolled list: chunks of CHUNK_SIZE bytes (4 KB), each holding
+ * up to CHUNK_VALUES values, linked in both directions. Only the tail chunk may be
+ * partly filled, and no chunk in the list is empty.
+ *
+ * Next to the values the collection keeps its printed form, "v0,v1,...,vn", in a text
+ * buffer. Appending a value appends its text, and for every value the offset where its
+ * text starts is stored, so removing the last value just cuts the text there. Printing
+ * is then a single write of the buffer.
+ *
+ * With text_deferred set, the printed form is kept by whoever writes the output, in a
+ * CollectionText (see pipeline.c). The text buffer is then still sized and allocated
+ * as usual, so that the allocator sees the same requests and its trace stays the same,
+ * but the values are not formatted into it */
+#define CHUNK_VALUES 509
+
+typedef struct Chunk {
+    struct Chunk* next;
+    struct Chunk* prev;
+    int count;       // Values in use
+    int values[CHUNK_VALUES];
+    unsigned int text_start[CHUNK_VALUES];   // Offset of each value's text, including the comma before it
+} Chunk;
+
+#define CHUNK_SIZE sizeof(Chunk)
+
+/* Size of the Node that held each value when the collection was a linked list. The
+ * output still reports an allocation of this size, and the address of the value,
+ * for every value added, so it reads the same as it always did */
+#define NODE_SIZE sizeof(struct { int value; void* next; void* prev; })
+
+typedef struct Collection {
+    Chunk* head;
+    Chunk* tail;
+    Chunk* spare;    // Emptied chunk kept back so that add/remove at a chunk boundary do not hit the allocator
+    char* text;      // Printed form of the collection, text_len chars of text_size
+    size_t text_len;
+    size_t text_size;
+    int text_deferred;   // Printed form kept in a CollectionText elsewhere
+} Collection;
+
+#define COLLECTION_INIT { NULL, NULL, NULL, NULL, 0, 0, 0 }
+
+/* Printed form of a collection kept apart from it, by the thread that writes the output
+ * of the one changing the collection. Its memory is mapped with mmap, as the allocator
+ * is only used by that other thread */
+typedef struct CollectionText {
+    char* text;
+    size_t text_len;
+    size_t text_size;
+    unsigned int* starts;   // Offset of each value's text, including the comma before it
+    size_t count;
+    size_t starts_size;
+} CollectionText;
+
+#define COLLECTION_TEXT_INIT { NULL, 0, 0, NULL, 0, 0 }
+
+
+/* Function that can add a new element to the end of the collection. Returns where the
+ * value is stored, or NULL if there is no memory for it */
+int* add_element_to_collection(Collection* collection, int value);
+
+/* Function to remove the most recently added element from the collection */
+void remove_last_added_element(Collection* collection);
+
+/* Function meant to print the entire collection with appropriate separators and commas */
+void print_collection(Collection* collection);
+
+/* Function to return all chunks of the collection to the allocator */
+void free_collection(Collection* collection);
+
+/* Counterparts of the functions above for a CollectionText */
+void append_to_text(CollectionText* text, int value);
+void remove_last_from_text(CollectionText* text);
+void print_text(CollectionText* text);
+void free_text(CollectionText* text);
+
+#endif /* COLLECTION_H_ */
@@ -0,0 +1,127 @@
+
+/**
+ * @file   container_bench.cpp
+ * @brief  Container workloads on std::allocator versus the simple heap.
+ *
+ *   container_bench [N [ROUNDS]]
+ *
+ * Runs each workload ROUNDS times (default 20) on N elements (default 100000)
+ * with std::allocator (the C library malloc), simple::SimpleAllocator, and
+ * std::pmr containers on simple::resource(), and prints ns per element and
+ * operation. Built against the silent allocator objects, so no trace is printed.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+
+#include "simple_allocator.hpp"
+
+namespace {
+
+std::size_t n = 100000;
+int rounds = 20;
+unsigned long checksum = 0;   // Keeps the work from being optimised away
+
+std::vector<unsigned> keys;
+
+template <typename Vector>
+void vector_push(Vector v) {
+  for (std::size_t i = 0; i < n; i++) v.push_back(static_cast<int>(i));
+  checksum += v.size() + v[n / 2];
+}
+
+template <typename Map>
+void hash_map_churn(Map m) {
+  for (std::size_t i = 0; i < n; i++) m[keys[i]] = static_cast<int>(i);
+  for (std::size_t i = 0; i < n; i += 2) checksum += m.count(keys[i]);
+  for (std::size_t i = 0; i < n; i++) m.erase(keys[i]);
+  checksum += m.size();
+}
+
+template <typename Map>
+void tree_map_churn(Map m) {
+  for (std::size_t i = 0; i < n; i++) m.emplace(keys[i], static_cast<int>(i));
+  for (std::size_t i = 0; i < n; i += 2) m.erase(keys[i]);
+  for (std::size_t i = 0; i < n; i += 2) m.emplace(keys[i] + 1, 0);
+  checksum += m.size();
+}
+
+template <typename List>
+void list_fifo(List l) {
+  for (std::size_t i = 0; i < n; i++) {
+    l.push_back(static_cast<int>(i));
+    if (i % 4 == 3) {
+      l.pop_front();
+      l.pop_front();
+    }
+  }
+  checksum += l.size();
+}
+
+void run(const char* workload, const char* allocator, const std::function<void()>& body) {
+  auto start = std::chrono::steady_clock::now();
+  for (int r = 0; r < rounds; r++) body();
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  std::printf("%-10s %-16s %8.1f ns/element\n", workload, allocator, static_cast<double>(ns) / rounds / n);
+}
+
+template <typename T>
+using simple_vector = std::vector<T, simple::SimpleAllocator<T>>;
+
+template <typename K, typename V>
+using simple_unordered_map =
+    std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, simple::SimpleAllocator<std::pair<const K, V>>>;
+
+template <typename K, typename V>
+using simple_map = std::map<K, V, std::less<K>, simple::SimpleAllocator<std::pair<const K, V>>>;
+
+template <typename T>
+using simple_list = std::list<T, simple::SimpleAllocator<T>>;
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::pmr::memory_resource* heap = simple::resource();
+  unsigned long state = 1;
+
+  if (argc > 1) n = std::strtoul(argv[1], nullptr, 10);
+  if (argc > 2) rounds = std::atoi(argv[2]);
+  if (n < 2) n = 2;
+  if (rounds < 1) rounds = 1;
+
+  keys.resize(n);
+  for (auto& k : keys) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    k = static_cast<unsigned>(state);
+  }
+
+  std::printf("%zu elements, %d rounds\n", n, rounds);
+
+  run("vector", "std::allocator", [] { vector_push(std::vector<int>()); });
+  run("vector", "SimpleAllocator", [] { vector_push(simple_vector<int>()); });
+  run("vector", "pmr simple", [heap] { vector_push(std::pmr::vector<int>(heap)); });
+
+  run("unordered", "std::allocator", [] { hash_map_churn(std::unordered_map<unsigned, int>()); });
+  run("unordered", "SimpleAllocator", [] { hash_map_churn(simple_unordered_map<unsigned, int>()); });
+  run("unordered", "pmr simple", [heap] { hash_map_churn(std::pmr::unordered_map<unsigned, int>(heap)); });
+
+  run("map", "std::allocator", [] { tree_map_churn(std::map<unsigned, int>()); });
+  run("map", "SimpleAllocator", [] { tree_map_churn(simple_map<unsigned, int>()); });
+  run("map", "pmr simple", [heap] { tree_map_churn(std::pmr::map<unsigned, int>(heap)); });
+
+  run("list", "std::allocator", [] { list_fifo(std::list<int>()); });
+  run("list", "SimpleAllocator", [] { list_fifo(simple_list<int>()); });
+  run("list", "pmr simple", [heap] { list_fifo(std::pmr::list<int>(heap)); });
+
+  std::printf("checksum %lu\n", checksum);
+  return 0;
+}
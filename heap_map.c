@@ -0,0 +1,234 @@
+
+/**
+ * @file   heap_map.c
+ * @brief  Renders a heap map written by simple_heap_map_write (or SIMPLE_HEAP_MAP).
+ *
+ *   heap_map FILE [COLUMNS [ROWS]]
+ *
+ * Prints a summary of the blocks, a fragmentation map of the arena and a size
+ * histogram. The map has ROWS lines (default 32) of COLUMNS cells (default 64),
+ * each standing for an equal share of the arena, marked by how much of the
+ * blocks in it is free:
+ *
+ *   '#' none   '+' under 1/4   ':' under 1/2   '.' 1/2 or more   ' ' all
+ *
+ * and '-' if it holds no block at all (e.g. the header array of MM_OOB_META).
+ * Cells that hold long-lived blocks (see simple_malloc_hint) are marked 'L'
+ * instead if none of it is free and 'l' if some is. The histogram
+ * counts the used and the free blocks by powers of two of their size.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "io.h"
+#include "mm.h"
+
+#define SIZE_CLASSES 33               // 2^0 up to 2^32
+#define BAR_WIDTH    30
+
+struct cell {
+  unsigned long covered;              // Bytes of blocks in the cell
+  unsigned long free;
+  int long_lived;
+};
+
+struct size_class {
+  unsigned long used, free;
+  unsigned long used_bytes, free_bytes;
+};
+
+static int
+size_class_of(unsigned long size) {
+  int c = 0;
+
+  while (size > 1) {
+    size >>= 1;
+    c++;
+  }
+  return c;
+}
+
+static void
+summary(const SimpleHeapMapHeader* h, const SimpleHeapMapBlock* b) {
+  unsigned long used = 0, used_bytes = 0, free = 0, free_bytes = 0, largest = 0;
+  unsigned long long_lived_bytes = 0, wilderness = 0;
+  unsigned long frag;
+  uint64_t i;
+
+  for (i = 0; i < h->blocks; i++) {
+    if (b[i].flags & SIMPLE_BLOCK_FREE) {
+      free++;
+      free_bytes += b[i].size;
+      if (b[i].size > largest) largest = b[i].size;
+      if (b[i].flags & SIMPLE_BLOCK_WILDERNESS) wilderness = b[i].size;
+    } else {
+      used++;
+      used_bytes += b[i].size;
+    }
+    if (b[i].flags & SIMPLE_BLOCK_LONG_LIVED) long_lived_bytes += b[i].size + h->overhead;
+  }
+  frag = free_bytes ? 1000 - largest * 1000 / free_bytes : 0;
+
+  write_fmt("arena %lu KB, %lu blocks, alignment %u, %u header bytes per block\n",
+            (unsigned long)(h->arena_size >> 10), (unsigned long)h->blocks, h->alignment, h->overhead);
+  write_fmt("used  %10lu KB in %8lu blocks\n", used_bytes >> 10, used);
+  write_fmt("free  %10lu KB in %8lu blocks, largest %lu KB, wilderness %lu KB\n",
+            free_bytes >> 10, free, largest >> 10, wilderness >> 10);
+  write_fmt("long-lived region %lu KB\n", long_lived_bytes >> 10);
+  write_fmt("fragmentation %lu.%lu%% (1 - largest free / free)\n\n", frag / 10, frag % 10);
+}
+
+static void
+render_map(const SimpleHeapMapHeader* h, const SimpleHeapMapBlock* b, size_t columns, size_t rows) {
+  size_t cells = columns * rows;
+  unsigned long cell_bytes = (h->arena_size + cells - 1) / cells;
+  struct cell* map = calloc(cells, sizeof(struct cell));
+  char* line = malloc(columns + 1);
+  uint64_t i;
+  size_t r, c;
+
+  if (map == NULL || line == NULL || cell_bytes == 0) {
+    free(map);
+    free(line);
+    return;
+  }
+
+  // Spread every block over the cells it covers
+  for (i = 0; i < h->blocks; i++) {
+    unsigned long start = b[i].offset;
+    unsigned long end = start + b[i].size;
+
+    while (start < end && start / cell_bytes < cells) {
+      size_t k = start / cell_bytes;
+      unsigned long cell_end = (k + 1) * cell_bytes;
+      unsigned long n = (end < cell_end ? end : cell_end) - start;
+
+      map[k].covered += n;
+      if (b[i].flags & SIMPLE_BLOCK_FREE) map[k].free += n;
+      if (b[i].flags & SIMPLE_BLOCK_LONG_LIVED) map[k].long_lived = 1;
+      start += n;
+    }
+  }
+
+  write_fmt("map, %lu bytes per cell\n", cell_bytes);
+  for (r = 0; r < rows; r++) {
+    for (c = 0; c < columns; c++) {
+      const struct cell* m = &map[r * columns + c];
+      char mark;
+
+      if (m->covered == 0) mark = '-';
+      else if (m->free == m->covered) mark = ' ';
+      else if (m->free == 0) mark = m->long_lived ? 'L' : '#';
+      else if (m->long_lived) mark = 'l';
+      else if (m->free < m->covered / 4) mark = '+';
+      else if (m->free < m->covered / 2) mark = ':';
+      else mark = '.';
+      line[c] = mark;
+    }
+    line[columns] = '\0';
+    write_fmt("%10lu |%s|\n", (unsigned long)(r * columns * cell_bytes), line);
+  }
+  write_char('\n');
+  free(map);
+  free(line);
+}
+
+static void
+histogram(const SimpleHeapMapHeader* h, const SimpleHeapMapBlock* b) {
+  struct size_class classes[SIZE_CLASSES];
+  unsigned long most = 1;
+  char bar[BAR_WIDTH + 1];
+  char range[48];
+  uint64_t i;
+  int c;
+
+  memset(classes, 0, sizeof(classes));
+  for (i = 0; i < h->blocks; i++) {
+    struct size_class* s = &classes[size_class_of(b[i].size)];
+
+    if (b[i].flags & SIMPLE_BLOCK_FREE) {
+      s->free++;
+      s->free_bytes += b[i].size;
+    } else {
+      s->used++;
+      s->used_bytes += b[i].size;
+    }
+  }
+  for (c = 0; c < SIZE_CLASSES; c++) {
+    if (classes[c].used > most) most = classes[c].used;
+    if (classes[c].free > most) most = classes[c].free;
+  }
+
+  write_fmt("%21s %10s %10s %10s %10s\n", "size", "used", "used KB", "free", "free KB");
+  for (c = 0; c < SIZE_CLASSES; c++) {
+    const struct size_class* s = &classes[c];
+    size_t used_len, free_len, k;
+
+    if (s->used == 0 && s->free == 0) continue;
+    k = format_long(range, 1L << c);
+    range[k++] = '-';
+    k += format_long(range + k, (2L << c) - 1);
+    range[k] = '\0';
+
+    // '#' for used and '.' for free blocks, scaled to the largest count
+    used_len = (s->used * BAR_WIDTH + most - 1) / most;
+    free_len = (s->free * BAR_WIDTH + most - 1) / most;
+    if (used_len + free_len > BAR_WIDTH) free_len = BAR_WIDTH - used_len;
+    memset(bar, '#', used_len);
+    memset(bar + used_len, '.', free_len);
+    bar[used_len + free_len] = '\0';
+
+    write_fmt("%21s %10lu %10lu %10lu %10lu %s\n", range, s->used, s->used_bytes >> 10,
+              s->free, s->free_bytes >> 10, bar);
+  }
+}
+
+int
+main(int argc, char** argv) {
+  const SimpleHeapMapHeader* h;
+  size_t columns = 64;
+  size_t rows = 32;
+  struct stat st;
+  void* file;
+  int fd;
+
+  if (argc < 2) {
+    write_string("Usage: heap_map FILE [COLUMNS [ROWS]]\n");
+    return 2;
+  }
+  if (argc > 2) columns = strtoul(argv[2], NULL, 10);
+  if (argc > 3) rows = strtoul(argv[3], NULL, 10);
+  if (columns == 0) columns = 1;
+  if (rows == 0) rows = 1;
+
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SimpleHeapMapHeader)) {
+    write_fmt("Cannot read heap map %s\n", argv[1]);
+    return 1;
+  }
+  file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    write_fmt("Cannot read heap map %s\n", argv[1]);
+    return 1;
+  }
+
+  h = file;
+  if (h->magic != SIMPLE_HEAP_MAP_MAGIC ||
+      (st.st_size - sizeof(*h)) / sizeof(SimpleHeapMapBlock) < h->blocks) {
+    write_fmt("%s is not a complete heap map\n", argv[1]);
+    return 1;
+  }
+
+  summary(h, (const SimpleHeapMapBlock*)(h + 1));
+  render_map(h, (const SimpleHeapMapBlock*)(h + 1), columns, rows);
+  histogram(h, (const SimpleHeapMapBlock*)(h + 1));
+  munmap(file, st.st_size);
+  return 0;
+}
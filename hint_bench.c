@@ -0,0 +1,162 @@
+
+/**
+ * @file   hint_bench.c
+ * @brief  Fragmentation with and without lifetime hints (simple_malloc_hint).
+ *
+ *   hint_bench [STEPS [SEED]]
+ *
+ * Replays the same request-like workload twice, each time in a fresh process
+ * (so on a fresh heap): STEPS steps (default 1000000) that each allocate a
+ * short-lived buffer, freed again within the next WINDOW steps, and now and then
+ * a long-lived cache entry, of which at most CACHE_ENTRIES are kept (a random one
+ * is evicted when the cache is full). The first run uses simple_malloc for all of
+ * them, the second SIMPLE_SHORT_LIVED and SIMPLE_LONG_LIVED hints.
+ *
+ * Fragmentation is 1 - largest free block / free bytes. It is sampled every
+ * STEPS / SAMPLES steps and once more at the end, when only the cache is left.
+ * Also reported: allocations that failed, free blocks at the end and ns per step.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "io.h"
+#include "mm.h"
+
+#define WINDOW        512
+#define CACHE_ENTRIES 20000
+#define LONG_EVERY    8             // One cache entry per this many steps on average
+#define SAMPLES       20
+
+struct result {
+  double ns_per_step;
+  unsigned long failed;
+  unsigned long avg_fragmentation;  // Per mille
+  unsigned long end_fragmentation;
+  size_t end_free_blocks;
+  size_t end_free;
+  size_t end_largest;
+};
+
+static unsigned long
+next_random(unsigned long* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static unsigned long
+fragmentation(size_t* free_bytes, size_t* largest, size_t* blocks) {
+  simple_free_stats(free_bytes, largest, blocks);
+  return *free_bytes ? 1000 - *largest * 1000 / *free_bytes : 0;
+}
+
+static void
+workload(unsigned long steps, unsigned long seed, int hints, struct result* r) {
+  static void* window[WINDOW];
+  static void* cache[CACHE_ENTRIES];
+  unsigned long state = seed * 0x9E3779B97F4A7C15UL + 1;
+  unsigned long sampled = 0;
+  unsigned long sum = 0;
+  size_t free_bytes, largest, blocks;
+  size_t cached = 0;
+  struct timespec start, end;
+  unsigned long i;
+
+  memset(r, 0, sizeof(*r));
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < steps; i++) {
+    unsigned long x = next_random(&state);
+    size_t slot = i % WINDOW;
+
+    // Short-lived: 32 to 2048 bytes, freed WINDOW steps later
+    simple_free(window[slot]);
+    window[slot] = hints ? simple_malloc_hint(32 + x % 2017, SIMPLE_SHORT_LIVED) : simple_malloc(32 + x % 2017);
+    if (window[slot] == NULL) r->failed++;
+
+    // Long-lived: 16 to 256 bytes, kept until evicted
+    if ((x >> 24) % LONG_EVERY == 0) {
+      size_t size = 16 + (x >> 32) % 241;
+      size_t k = cached < CACHE_ENTRIES ? cached++ : (x >> 40) % CACHE_ENTRIES;
+
+      simple_free(cache[k]);
+      cache[k] = hints ? simple_malloc_hint(size, SIMPLE_LONG_LIVED) : simple_malloc(size);
+      if (cache[k] == NULL) r->failed++;
+    }
+
+    if (i % (steps / SAMPLES + 1) == 0) {
+      sum += fragmentation(&free_bytes, &largest, &blocks);
+      sampled++;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (i = 0; i < WINDOW; i++) {
+    simple_free(window[i]);
+  }
+  r->ns_per_step = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / steps;
+  r->avg_fragmentation = sampled ? sum / sampled : 0;
+  r->end_fragmentation = fragmentation(&r->end_free, &r->end_largest, &r->end_free_blocks);
+}
+
+/* Runs the workload in a child process and collects its result through a pipe */
+static int
+run(unsigned long steps, unsigned long seed, int hints, struct result* r) {
+  int fds[2];
+  pid_t pid;
+  ssize_t n;
+
+  if (pipe(fds) != 0) return -1;
+  pid = fork();
+  if (pid < 0) return -1;
+  if (pid == 0) {
+    close(fds[0]);
+    workload(steps, seed, hints, r);
+    _exit(write(fds[1], r, sizeof(*r)) == sizeof(*r) ? 0 : 1);
+  }
+  close(fds[1]);
+  n = read(fds[0], r, sizeof(*r));
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+  return n == sizeof(*r) ? 0 : -1;
+}
+
+static void
+report(const char* mode, const struct result* r) {
+  write_fmt("%10s %8lu %8lu %6lu.%lu%% %6lu.%lu%% %12zu %10zu %10zu\n", mode,
+            (unsigned long)r->ns_per_step, r->failed,
+            r->avg_fragmentation / 10, r->avg_fragmentation % 10,
+            r->end_fragmentation / 10, r->end_fragmentation % 10,
+            r->end_free_blocks, r->end_free / 1024, r->end_largest / 1024);
+}
+
+int
+main(int argc, char** argv) {
+  unsigned long steps = 1000000;
+  unsigned long seed = 1;
+  struct result r;
+  int hints;
+
+  if (argc > 1) steps = strtoul(argv[1], NULL, 10);
+  if (argc > 2) seed = strtoul(argv[2], NULL, 10);
+  if (steps == 0) steps = 1;
+
+  write_fmt("%lu steps, seed %lu\n", steps, seed);
+  write_fmt("%10s %8s %8s %8s %8s %12s %10s %10s\n", "mode", "ns/step", "failed",
+            "avg frag", "end frag", "free blocks", "free KB", "largest KB");
+  for (hints = 0; hints < 2; hints++) {
+    const char* mode = hints ? "hints" : "no hints";
+
+    if (run(steps, seed, hints, &r) == 0) {
+      report(mode, &r);
+    } else {
+      write_fmt("%10s failed\n", mode);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+
+/* You are not allowed to use <stdio.h> */
+#include "io.h"
+#include "interp.h"
+
+static void write_increments(int from, size_t count) {
+    size_t i;
+
+    for (i = 1; i <= count; i++) {
+        write_string("Incrementing counter to ");
+        write_int(from + i);
+        write_char('\n');
+    }
+}
+
+/* Writes the lines reporting that value was added at slot, or NULL if it was not */
+static void write_added(const int* slot, int value) {
+    if (slot) {
+        write_fmt("Allocated new node at %p\n", (void*)slot);
+        write_string("Adding node with value: ");
+        write_int(value);
+        write_char('\n');
+    }
+    write_string("Allocating ");
+    write_int(NODE_SIZE);
+    write_string(" bytes\n");
+}
+
+/* Writes the output of a run of count commands c, or reports it (see report_run) */
+static void output_run(Interpreter* interp, char c, int value, const int* slot, size_t count) {
+    size_t i;
+
+    if (interp->report_run) {
+        interp->report_run(interp->report_arg, c, value, slot, count);
+    } else if (c == 'a') {
+        write_added(slot, value);
+    } else if (c == 'b') {
+        write_increments(value, count);
+    } else if (c == 'c') {
+        for (i = 0; i < count; i++) {
+            write_string("Freeing last added element\n");
+        }
+    } else if (c == '\n') {
+        for (i = 0; i < count; i++) {
+            write_string("Current collection: ");
+            print_collection(&interp->collection);
+        }
+    } else {
+        // Anything else, including the end of input, ends the program
+        write_string("Invalid input. Exiting...\n");
+
+        // Call to function for printing the collection as a list separated by commas
+        print_collection(&interp->collection);
+    }
+}
+
+void interp_defer_output(Interpreter* interp, void (*report)(void*, char, int, const int*, size_t), void* arg) {
+    interp->report_run = report;
+    interp->report_arg = arg;
+    interp->collection.text_deferred = 1;
+}
+
+int interp_run(Interpreter* interp, char c, size_t count) {
+    size_t i;
+
+    if (c == 'a') {
+        for (i = 0; i < count; i++) {
+            output_run(interp, c, interp->counter, add_element_to_collection(&interp->collection, interp->counter), 1);
+            interp->counter++;
+        }
+    } else if (c == 'b') {
+        // The counter moves by the whole run, but every step is still reported
+        output_run(interp, c, interp->counter, NULL, count);
+        interp->counter += count;
+    } else if (c == 'c') {
+        // One at a time, the allocator may report freeing the chunk in between
+        for (i = 0; i < count; i++) {
+            remove_last_added_element(&interp->collection);
+            output_run(interp, c, interp->counter, NULL, 1);
+        }
+    } else if (c == '\n') {
+        // If Enter is pressed, print the current collection
+        output_run(interp, c, interp->counter, NULL, count);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void write_run(CollectionText* text, char c, int value, const int* slot, size_t count) {
+    size_t i;
+
+    if (c == 'a') {
+        for (i = 0; i < count; i++) {
+            if (slot) {
+                append_to_text(text, value + i);
+            }
+            write_added(slot ? slot + i : NULL, value + i);
+        }
+    } else if (c == 'b') {
+        write_increments(value, count);
+    } else if (c == 'c') {
+        for (i = 0; i < count; i++) {
+            remove_last_from_text(text);
+            write_string("Freeing last added element\n");
+        }
+    } else if (c == '\n') {
+        for (i = 0; i < count; i++) {
+            write_string("Current collection: ");
+            print_text(text);
+        }
+    } else {
+        write_string("Invalid input. Exiting...\n");
+        print_text(text);
+    }
+}
+
+void interp_finish(Interpreter* interp) {
+    output_run(interp, 0, interp->counter, NULL, 1);
+
+    // Clean up remaining chunks
+    free_collection(&interp->collection);
+}
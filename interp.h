@@ -0,0 +1,48 @@
+
+#ifndef INTERP_H_
+#define INTERP_H_
+
+#include <stddef.h>
+#include "collection.h"
+
+/* State of the command interpreter: the collection and the counter. Commands are
+ * single bytes; a appends the counter to the collection, b increments the counter,
+ * c removes the last added value and a newline prints the collection. Output goes
+ * through the io.h write functions of the calling thread */
+typedef struct Interpreter {
+    Collection collection;
+    int counter;
+    /* If set, called for every run of count commands c instead of writing their output,
+     * which write_run() writes later from the arguments, e.g. on another thread. For a
+     * and c it is called once per command, as the allocator may write its trace in
+     * between: for a with the value and the slot it is stored in (NULL if there was no
+     * memory for it). For b, value is the counter before the run. The end of the
+     * session is reported as c 0. The collection does not keep its printed form then
+     * (text_deferred), the caller of write_run() keeps it instead */
+    void (*report_run)(void* arg, char c, int value, const int* slot, size_t count);
+    void* report_arg;
+} Interpreter;
+
+#define INTERPRETER_INIT { COLLECTION_INIT, 0, NULL, NULL }
+
+/* Makes interp report its runs to report instead of writing their output */
+void interp_defer_output(Interpreter* interp, void (*report)(void*, char, int, const int*, size_t), void* arg);
+
+/* Returns 1 if c is a command, 0 if it ends the session */
+static inline int interp_is_command(char c) {
+    return c == 'a' || c == 'b' || c == 'c' || c == '\n';
+}
+
+/* Executes a run of count identical commands c. Returns 1, or 0 if c is not a
+ * command, which ends the session */
+int interp_run(Interpreter* interp, char c, size_t count);
+
+/* Writes the closing message and the final collection, and frees the collection */
+void interp_finish(Interpreter* interp);
+
+/* Writes the output of a run reported by report_run, keeping the printed form of the
+ * collection in text. Reports of c that follow each other, and of a with consecutive
+ * values and slots, may be merged into one run */
+void write_run(CollectionText* text, char c, int value, const int* slot, size_t count);
+
+#endif /* INTERP_H_ */
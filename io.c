@@ -1,100 +1,472 @@
 
+#define _GNU_SOURCE
 #include <errno.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
-#include "mm.h"
 #include "io.h"
+#include "uring.h"
 
-/* Reads next char from stdin. If no more characters, it returns EOF */
+static char in_buffer[IO_INPUT_BUFFER_SIZE];
+
+const char * io_in_pos = in_buffer;
+const char * io_in_end = in_buffer;
+
+/* I/O backend: -1 until the first I/O, then 1 for io_uring (SIMPLE_IO=uring) or 0 for read/write */
+static int use_uring = -1;
+
+/* Keeps the io_uring backend, which is meant for a single thread, off */
+void
+io_use_threads(void) {
+  if (use_uring < 0) {
+    use_uring = 0;
+  }
+}
+
+static int
+uring_enabled() {
+  if (use_uring < 0) {
+    const char* backend = getenv("SIMPLE_IO");
+    use_uring = backend != NULL && strcmp(backend, "uring") == 0 && uring_setup() == 0;
+  }
+  return use_uring;
+}
+
+/* Input mode: -1 until the first read, 1 if stdin is a memory mapped regular file, 0 otherwise */
+static int input_mapped = -1;
+
+/* Maps a regular file on stdin from its current offset to its end and makes the mapping
+ * the input buffer. Returns 1 if it did, 0 to leave stdin to read(2) (pipes, terminals,
+ * empty files, or if mmap fails) */
+static int
+map_input() {
+  struct stat st;
+  off_t offset;
+  char* map;
+
+  if (fstat(0, &st) != 0 || !S_ISREG(st.st_mode)) return 0;
+  offset = lseek(0, 0, SEEK_CUR);
+  if (offset < 0 || offset >= st.st_size) return 0;
+
+  // The mapping must start on a page boundary, so map from 0 and skip to the offset
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, 0, 0);
+  if (map == MAP_FAILED) return 0;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  lseek(0, st.st_size, SEEK_SET);
+
+  io_in_pos = map + offset;
+  io_in_end = map + st.st_size;
+  return 1;
+}
+
+/* Reads the next block of stdin into the input buffer. Returns the number of bytes, 0 if no more */
+static size_t
+fill_input() {
+  ssize_t n;
+
+  if (input_mapped < 0) {
+    input_mapped = map_input();
+    if (input_mapped) {
+      return io_in_end - io_in_pos;
+    }
+  }
+  if (input_mapped) {
+    return 0;                   // The whole file was handed out at once
+  }
+
+  if (uring_enabled()) {
+    // The block is read ahead into a buffer of the backend; use it in place
+    const char* data = in_buffer;
+    n = uring_read(&data);
+    io_in_pos = data;
+    io_in_end = data + n;
+    return n;
+  }
+
+  do {
+    n = read(0, in_buffer, sizeof(in_buffer));
+  } while (n < 0 && errno == EINTR);
+
+  io_in_pos = in_buffer;
+  io_in_end = in_buffer + (n > 0 ? n : 0);
+  return io_in_end - io_in_pos;
+}
+
+/* Refills the input buffer and returns its first char, or EOF if no more characters */
 int
-read_char() {
-  char c;
-  if (read(0, &c, 1) == 1)
-  {
-    return c;
-  } else {
+io_refill(void) {
+  if (fill_input() == 0) {
     return EOF;
   }
+  return *io_in_pos++;
+}
+
+/* Hands out the rest of the input buffer, refilling it first if it is empty */
+size_t
+read_span(const char ** span) {
+  size_t len;
+
+  if (io_in_pos == io_in_end && fill_input() == 0) {
+    return 0;
+  }
+  *span = io_in_pos;
+  len = io_in_end - io_in_pos;
+  io_in_pos = io_in_end;
+  return len;
+}
+
+static char out_buffer[IO_OUTPUT_BUFFER_SIZE];
+static size_t out_len = 0;
+static int line_buffered = -1;  // Decided on first output unless set_line_buffered() was called
+
+/* Output redirection of this thread, see set_output_sink() */
+static __thread output_sink thread_sink;
+static __thread void* thread_sink_arg;
+
+/* Writes all n bytes at p to stdout. If no errors occur, it returns 0, otherwise EOF */
+static int
+write_all(const char* p, size_t n) {
+  if (uring_enabled()) {
+    return uring_write(p, n);   // Returns once the bytes are queued
+  }
+  while (n > 0) {
+    ssize_t written = write(1, p, n);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return EOF;
+    }
+    p += written;
+    n -= written;
+  }
+  return 0;
+}
+
+/* Writes the count buffers of iov to stdout with writev(2), going on after short writes.
+ * If no errors occur, it returns 0, otherwise EOF */
+static int
+write_vectored(struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(1, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return EOF;
+    }
+    // Skip the buffers written completely and trim a partially written one
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static void
+flush_at_exit(void) {
+  flush_output();
+  if (use_uring > 0) {
+    uring_drain();
+  }
+}
+
+/* Picks line buffering for terminals and registers the flush at exit */
+static void
+setup_output() {
+  static int registered = 0;
+
+  if (line_buffered < 0) {
+    line_buffered = isatty(1);
+  }
+  if (!registered) {
+    registered = 1;
+    atexit(flush_at_exit);
+  }
+}
+
+/* Writes everything buffered so far to stdout. If no errors occur, it returns 0, otherwise EOF */
+int
+flush_output(void) {
+  int ret = write_all(out_buffer, out_len);
+  out_len = 0;
+  return ret;
+}
+
+/* Sends the output of the calling thread to sink, or back to stdout if sink is NULL */
+void
+set_output_sink(output_sink sink, void* arg) {
+  thread_sink = sink;
+  thread_sink_arg = arg;
+}
+
+/* Turns line buffered output on (flush after every newline) or off */
+void
+set_line_buffered(int on) {
+  setup_output();
+  line_buffered = on ? 1 : 0;
+}
+
+/* Appends n bytes to the output buffer, flushing it as needed */
+static int
+put_bytes(const char* p, size_t n) {
+  int ret = 0;
+
+  if (thread_sink) {
+    thread_sink(thread_sink_arg, p, n);
+    return 0;
+  }
+  setup_output();
+  if (n >= sizeof(out_buffer) && !uring_enabled()) {
+    // Too large to be worth copying: one writev(2) sends what is buffered and p together
+    struct iovec iov[2];
+    iov[0].iov_base = out_buffer;
+    iov[0].iov_len = out_len;
+    iov[1].iov_base = (void*)p;
+    iov[1].iov_len = n;
+    out_len = 0;
+    return write_vectored(iov, 2);
+  }
+  if (n > sizeof(out_buffer) - out_len) {
+    ret = flush_output();
+  }
+  if (n >= sizeof(out_buffer)) {
+    return write_all(p, n) == 0 ? ret : EOF;  // io_uring: both writes are only queued
+  }
+  memcpy(out_buffer + out_len, p, n);
+  out_len += n;
+  if (line_buffered && memchr(p, '\n', n) != NULL) {
+    ret = flush_output();
+  }
+  return ret;
 }
 
 /* Writes c to stdout.  If no errors occur, it returns 0, otherwise EOF */
 int
 write_char(char c) {
-  if (write(1, &c, 1) == 1)
-  {
+  if (!thread_sink && line_buffered == 0 && out_len < sizeof(out_buffer)) {
+    out_buffer[out_len++] = c;
     return 0;
-  } else {
-    return EOF;
   }
+  return put_bytes(&c, 1);
+}
+
+/* Writes n bytes at p to stdout.  If no errors occur, it returns 0, otherwise EOF */
+int
+write_bytes(const char* p, size_t n) {
+  return put_bytes(p, n);
 }
 
 /* Writes a null-terminated string to stdout.  If no errors occur, it returns 0, otherwise EOF */
 int
 write_string(char* s) {
     int len = 0;
-    while (s[len] != '\0') len++; {
-        if (write(1, s, len) == len) {
-            return 0;
-        } else {
-      return EOF;
-        }
+    while (s[len] != '\0') {
+        len++;
     }
+    return put_bytes(s, len);
+}
+
+/* "00" to "99", used to convert two decimal digits per division */
+static const char digit_pairs[200] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* Formats n in decimal so that it ends just before end. Returns the first char */
+static char*
+format_ulong(char* end, unsigned long n) {
+  while (n >= 100) {
+    const char* pair = &digit_pairs[(n % 100) * 2];
+    n /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (n >= 10) {
+    *--end = digit_pairs[n * 2 + 1];
+    *--end = digit_pairs[n * 2];
+  } else {
+    *--end = '0' + n;
+  }
+  return end;
 }
 
 /* Writes n to stdout (without any formatting).   
  * If no errors occur, it returns 0, otherwise EOF
  */
+int
+write_ulong(unsigned long n) {
+  char buffer[20];
+  char* start = format_ulong(buffer + sizeof(buffer), n);
+  return put_bytes(start, buffer + sizeof(buffer) - start);
+}
 
-int write_int(int n) {
-    int countIn = n;
-    int length = 0;
-    
-    // Handle negative numbers
-    if (n < 0) {
-        length++;
-        countIn = -n;
-    }
+/* Writes n to stdout (without any formatting).   
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+int
+write_long(long n) {
+  char buffer[21];
+  // Negate in unsigned arithmetic so that LONG_MIN works
+  char* start = format_ulong(buffer + sizeof(buffer), n < 0 ? 0UL - (unsigned long)n : (unsigned long)n);
+  if (n < 0) {
+    *--start = '-';
+  }
+  return put_bytes(start, buffer + sizeof(buffer) - start);
+}
 
-    // Handle the special case where n is 0
-    if (n == 0) {
-        length = 1;
-    } else {
-        while (countIn > 0) {
-            length++;
-            countIn /= 10; // Divide by 10 to get the next digit
-        }
-    }
+/* Formats n in decimal at the start of buffer. Returns the number of chars */
+size_t
+format_long(char* buffer, long n) {
+  char digits[21];
+  char* start = format_ulong(digits + sizeof(digits), n < 0 ? 0UL - (unsigned long)n : (unsigned long)n);
+  size_t len;
 
-  char *buffer = (char *)simple_malloc(length);
-  if (!buffer) {
-    return -1; // return error if memory allocation fails
+  if (n < 0) {
+    *--start = '-';
   }
-  int index = 0; // Initialize index to 0
+  len = digits + sizeof(digits) - start;
+  memcpy(buffer, start, len);
+  return len;
+}
 
-  if (n < 0) {
-    buffer[index++] = '-'; // Add a negative sign if n is negative
-    n = -n; // Make n positive
+/* Writes n to stdout (without any formatting).   
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+int
+write_int(int n) {
+  return write_long(n);
+}
+
+/* Writes n to stdout in lower case hexadecimal without prefix.
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+int
+write_hex(unsigned long n) {
+  char buffer[16];
+  char* start = buffer + sizeof(buffer);
+  do {
+    *--start = "0123456789abcdef"[n & 0xf];
+    n >>= 4;
+  } while (n != 0);
+  return put_bytes(start, buffer + sizeof(buffer) - start);
+}
+
+/* Writes len bytes at s padded on the left to width with pad */
+static int
+put_padded(const char* s, size_t len, size_t width, char pad) {
+  int ret = 0;
+  while (width > len) {
+    ret |= write_char(pad);
+    width--;
   }
+  return put_bytes(s, len) | ret;
+}
 
-  // when n is 0:
-  if (n == 0)
-  {
-    buffer[index++] = '0';
-  } else {  
-    while (n > 0) {
-        buffer[index++] = n % 10 + '0'; // Add the next digit to the buffer
-        n /= 10; // Divide by 10 to get the next digit
+/* Writes a formatted string to stdout without using the heap.
+ * Supports %d %u %x %p %s %c and %%, the length modifiers l and z,
+ * and a field width with optional 0 padding (e.g. %08lx). Other conversions
+ * are written as they are.
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+int
+write_fmt(const char* fmt, ...) {
+  va_list ap;
+  int ret = 0;
+
+  va_start(ap, fmt);
+  while (*fmt != '\0') {
+    const char* run = fmt;
+    const char* spec;
+    char buffer[24];
+    char* end = buffer + sizeof(buffer);
+    char* start = end;
+    char pad = ' ';
+    size_t width = 0;
+    int is_long = 0;
+
+    while (*fmt != '\0' && *fmt != '%') fmt++;
+    if (fmt > run) {
+      ret |= put_bytes(run, fmt - run);
     }
-  }
-  int bytes_written = 0; // Initialize bytes_written to 0
-  for (int i = index - 1; i >= 0; i--) {
-    if (write(1, &buffer[i], 1) == -1) {
-      return -1; // Return -1 if an error occurs
+    if (*fmt == '\0') break;
+
+    spec = fmt++;  // Skip '%'
+    if (*fmt == '0') {
+      pad = '0';
+      fmt++;
+    }
+    while (*fmt >= '0' && *fmt <= '9') {
+      width = width * 10 + (*fmt++ - '0');
+    }
+    if (*fmt == 'l' || *fmt == 'z') {
+      is_long = 1;
+      fmt++;
+    }
+
+    switch (*fmt) {
+    case 'd': {
+      long n = is_long ? va_arg(ap, long) : va_arg(ap, int);
+      start = format_ulong(end, n < 0 ? 0UL - (unsigned long)n : (unsigned long)n);
+      if (n < 0) *--start = '-';
+      break;
     }
-    bytes_written++;
+    case 'u':
+      start = format_ulong(end, is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int));
+      break;
+    case 'x':
+    case 'p': {
+      unsigned long n = *fmt == 'p' ? (unsigned long)(uintptr_t)va_arg(ap, void*)
+                      : is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int);
+      do {
+        *--start = "0123456789abcdef"[n & 0xf];
+        n >>= 4;
+      } while (n != 0);
+      if (*fmt == 'p') {
+        *--start = 'x';
+        *--start = '0';
+      }
+      break;
+    }
+    case 's': {
+      const char* str = va_arg(ap, const char*);
+      if (str == NULL) str = "(null)";
+      ret |= put_padded(str, strlen(str), width, ' ');
+      width = 0;
+      break;
+    }
+    case 'c':
+      *--start = (char)va_arg(ap, int);
+      break;
+    case '%':
+      *--start = '%';
+      break;
+    default:
+      // Unknown conversion, print it as is (without padding it to the width)
+      ret |= put_bytes(spec, fmt - spec + (*fmt != '\0'));
+      break;
+    }
+    if (start < end && pad == '0' && *start == '-' && width > 0) {
+      // The sign goes in front of the zeros
+      ret |= write_char(*start++);
+      width--;
+    }
+    if (start < end) {
+      ret |= put_padded(start, end - start, width, pad);
+    }
+    if (*fmt != '\0') fmt++;
   }
-  
-  simple_free(buffer); // Free the allocated memory. Because we use malloc!  
-  return bytes_written;  // Return the number of bytes written
-}
\ No newline at end of file
+  va_end(ap);
+
+  return ret ? EOF : 0;
+}
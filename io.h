@@ -7,11 +7,70 @@
  *  <stdio.h> which is not to be used.
  */
 
+#include <stddef.h>
+
 #define EOF (-1)
 
+/* Size of the input buffer; stdin is read in blocks of this many bytes. A regular
+ * file on stdin is memory mapped instead and handed out as a single block */
+#define IO_INPUT_BUFFER_SIZE (64 * 1024)
+
+/* Unread part of the input buffer. Use read_char() and read_span() instead of these */
+extern const char * io_in_pos;
+extern const char * io_in_end;
+
+/* Refills the input buffer from stdin and returns its first char (consumed),
+ * or EOF if no more characters. Called by read_char() when the buffer is empty */
+extern int
+io_refill(void);
+
 /* Reads next char from stdin. If no more characters, it returns EOF */
+static inline int
+read_char(void) {
+  if (io_in_pos < io_in_end) {
+    return *io_in_pos++;
+  }
+  return io_refill();
+}
+
+/* Makes the next buffered part of stdin available at *span without copying and
+ * consumes it. The span stays valid until the next read. Returns its length, or 0
+ * if no more characters */
+extern size_t
+read_span(const char ** span);
+
+/* Output is collected in a buffer of this size and written to stdout when it is
+ * full, when flush_output() is called, at exit, and in line buffered mode after
+ * every newline. Errors of the write(2) calls are reported by the call that
+ * triggers them.
+ *
+ * With SIMPLE_IO=uring in the environment, stdin is read ahead and stdout is
+ * written through io_uring (see uring.h): a flush then only queues the buffer,
+ * errors surface on a later call, and the queue is drained at exit. Without
+ * io_uring support the plain system calls are used */
+#define IO_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+/* Writes all buffered output to stdout.  If no errors occur, it returns 0, otherwise EOF */
 extern int
-read_char();
+flush_output(void);
+
+/* Enables (on != 0) or disables line buffered output. The default is line
+ * buffered if stdout is a terminal, fully buffered otherwise */
+extern void
+set_line_buffered(int on);
+
+/* Output redirection for the calling thread. While a sink is set, the write functions
+ * called on this thread pass their output to sink(arg, p, n) instead of buffering it
+ * for stdout; other threads are not affected. NULL restores normal output */
+typedef void (*output_sink)(void* arg, const char* p, size_t n);
+
+extern void
+set_output_sink(output_sink sink, void* arg);
+
+/* Must be called before stdin and stdout are used from more than one thread (each
+ * by one thread at a time). The io_uring backend is not used from then on */
+extern void
+io_use_threads(void);
 
 /* Writes a character to stdout.  If no errors occur, it returns 0, otherwise EOF */
 extern int
@@ -21,10 +80,45 @@ write_char(char c);
 extern int
 write_string(char* s);
 
+/* Writes n bytes at p to stdout.  If no errors occur, it returns 0, otherwise EOF */
+extern int
+write_bytes(const char* p, size_t n);
+
 /* Writes n to stdout (without any formatting).   
  * If no errors occur, it returns 0, otherwise EOF
  */
 extern int
 write_int(int n);
 
+/* Writes n to stdout (without any formatting).   
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+extern int
+write_long(long n);
+
+/* Writes n to stdout (without any formatting).   
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+extern int
+write_ulong(unsigned long n);
+
+/* Writes n to stdout in lower case hexadecimal without prefix or padding.
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+extern int
+write_hex(unsigned long n);
+
+/* Formats n in decimal into buffer, which must hold at least 20 chars, without
+ * a terminating null. Returns the number of chars */
+extern size_t
+format_long(char* buffer, long n);
+
+/* Writes a formatted string to stdout without using the heap, so it is safe to
+ * call from the allocator. Supports %d %u %x %p %s %c and %%, the length
+ * modifiers l and z, and a field width with optional 0 padding (e.g. %08lx).
+ * If no errors occur, it returns 0, otherwise EOF
+ */
+extern int
+write_fmt(const char* fmt, ...);
+
 #endif /* IO_H_ */
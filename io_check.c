@@ -0,0 +1,47 @@
+/**
+ * @file   io_check.c
+ * @brief  Writes fixed values through the number and format writers of io.c.
+ *
+ * test_io.sh compares the output with the text it expects, covering the
+ * extremes of write_int, write_long and format_long and each conversion of
+ * write_fmt, including the ones it does not know.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "io.h"
+
+int
+main(void) {
+  char buffer[24];
+
+  write_int(INT_MIN);
+  write_char(' ');
+  write_int(INT_MAX);
+  write_char(' ');
+  write_int(0);
+  write_char('\n');
+  write_long(LONG_MIN);
+  write_char(' ');
+  write_long(LONG_MAX);
+  write_char(' ');
+  write_ulong(ULONG_MAX);
+  write_char(' ');
+  write_hex(0xbeef);
+  write_char('\n');
+  write_bytes(buffer, format_long(buffer, LONG_MIN));
+  write_char(' ');
+  write_bytes(buffer, format_long(buffer, -7));
+  write_char('\n');
+
+  write_fmt("%d %d %d %ld %ld\n", INT_MIN, INT_MAX, -1, LONG_MIN, LONG_MAX);
+  write_fmt("%u %lu %zu\n", UINT_MAX, ULONG_MAX, (size_t)42);
+  write_fmt("%x %lx %08lx %p\n", 0xabcu, 0xdeadbeefUL, 0x1fUL, (void*)0x1234);
+  write_fmt("[%5d] [%05d] [%03d] [%2d]\n", 42, -42, -12345, 12345);
+  write_fmt("[%s] [%8s] [%s] [%c] [%3c]\n", "abc", "abc", (const char*)NULL, 'x', 'y');
+  write_fmt("100%% [%5q] [%q] [%-3d] [%l] %\n");
+  write_fmt("%");
+  write_char('\n');
+  return flush_output() == 0 ? 0 : 1;
+}
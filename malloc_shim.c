@@ -0,0 +1,187 @@
+/**
+ * @file   malloc_shim.c
+ * @brief  LD_PRELOAD shim that routes the C library allocator onto simple_malloc.
+ *
+ * Built as libsimplemalloc.so together with mm.c (compiled with MM_SILENT, so the
+ * allocator never calls stdio). Run an unmodified program on the allocator with
+ *
+ *   LD_PRELOAD=./libsimplemalloc.so program ...
+ *
+ * All entry points are serialised by one mutex, which is held across fork so that
+ * the child never inherits it locked by a thread that does not exist there. Calls
+ * made while the same thread is already inside the allocator (e.g. from libc during
+ * initialisation) are served from a small static bootstrap area instead of recursing.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "mm.h"
+
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+/* malloc must suit any type. simple_malloc blocks are 16 byte aligned, which covers
+ * max_align_t; only larger alignments need simple_memalign */
+#define MALLOC_ALIGNMENT _Alignof(max_align_t)
+
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int shim_busy __attribute__((tls_model("initial-exec")));  // Thread is inside simple_*
+
+/* Bootstrap area for recursive calls. Each block is preceded by its size and never freed. */
+static _Alignas(MALLOC_ALIGNMENT) uint64_t bootstrap[BOOTSTRAP_SIZE / sizeof(uint64_t)];
+static size_t bootstrap_used = 0;
+
+static int is_bootstrap(void * ptr) {
+  return (uintptr_t) ptr >= (uintptr_t) bootstrap && (uintptr_t) ptr < (uintptr_t) bootstrap + sizeof(bootstrap);
+}
+
+static void * bootstrap_alloc(size_t alignment, size_t size) {
+  size_t words;
+  size_t start;
+  uint64_t * ptr;
+
+  if (size > BOOTSTRAP_SIZE || alignment > BOOTSTRAP_SIZE) {  // Also keeps words from wrapping around
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (alignment < MALLOC_ALIGNMENT) alignment = MALLOC_ALIGNMENT;
+  words = (size + alignment + 7) / 8 + 1;
+  start = __atomic_fetch_add(&bootstrap_used, words, __ATOMIC_RELAXED);
+  if (start + words > BOOTSTRAP_SIZE / sizeof(uint64_t)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = &bootstrap[start + 1];
+  ptr = (uint64_t *) (((uintptr_t) ptr + alignment - 1) & ~(uintptr_t) (alignment - 1));
+  ptr[-1] = size;
+  return ptr;
+}
+
+/* fork handlers: no other thread can be inside the allocator while the child is created */
+static void fork_prepare(void) {
+  pthread_mutex_lock(&shim_lock);
+}
+
+static void fork_parent(void) {
+  pthread_mutex_unlock(&shim_lock);
+}
+
+static void fork_child(void) {
+  pthread_mutex_init(&shim_lock, NULL);  // The child has only the forking thread
+}
+
+__attribute__((constructor)) static void shim_init(void) {
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+static size_t usable_size(void * ptr) {
+  if (is_bootstrap(ptr)) return ((uint64_t *) ptr)[-1];
+  return simple_usable_size(ptr);
+}
+
+static void * shim_alloc(size_t alignment, size_t size) {
+  void * ptr;
+
+  if (size == 0) size = 1;  // malloc(0) must return a unique pointer
+  if (shim_busy) return bootstrap_alloc(alignment, size);
+
+  pthread_mutex_lock(&shim_lock);
+  shim_busy = 1;
+  ptr = alignment ? simple_memalign(alignment, size) : simple_malloc(size);
+  shim_busy = 0;
+  pthread_mutex_unlock(&shim_lock);
+
+  if (ptr == NULL) errno = ENOMEM;
+  return ptr;
+}
+
+void * malloc(size_t size) {
+  return shim_alloc(0, size);
+}
+
+void free(void * ptr) {
+  if (ptr == NULL || is_bootstrap(ptr)) return;
+  if (shim_busy) return;  // Called from inside the allocator, which holds shim_lock: leak rather than deadlock
+
+  pthread_mutex_lock(&shim_lock);
+  shim_busy = 1;
+  simple_free(ptr);
+  shim_busy = 0;
+  pthread_mutex_unlock(&shim_lock);
+}
+
+void * calloc(size_t nmemb, size_t size) {
+  size_t total;
+  void * ptr;
+
+  if (__builtin_mul_overflow(nmemb, size, &total)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  ptr = shim_alloc(0, total);
+  if (ptr != NULL && !is_bootstrap(ptr)) memset(ptr, 0, total);  // Arena blocks are recycled
+  return ptr;
+}
+
+void * realloc(void * ptr, size_t size) {
+  size_t old_size;
+  void * new_ptr;
+
+  if (ptr == NULL) return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return NULL;
+  }
+
+  old_size = usable_size(ptr);
+  if (old_size >= size && !is_bootstrap(ptr)) return ptr;
+
+  new_ptr = malloc(size);
+  if (new_ptr == NULL) return NULL;
+  memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+  free(ptr);
+  return new_ptr;
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size) {
+  void * ptr;
+
+  if (alignment < sizeof(void *) || (alignment & (alignment - 1))) return EINVAL;
+  ptr = shim_alloc(alignment > MALLOC_ALIGNMENT ? alignment : 0, size);
+  if (ptr == NULL) return ENOMEM;
+  *memptr = ptr;
+  return 0;
+}
+
+void * memalign(size_t alignment, size_t size) {
+  if (alignment & (alignment - 1)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return shim_alloc(alignment > MALLOC_ALIGNMENT ? alignment : 0, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size) {
+  return memalign(alignment, size);
+}
+
+void * valloc(size_t size) {
+  return memalign(4096, size);
+}
+
+void * pvalloc(size_t size) {
+  if (size > SIZE_MAX - 4095) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return memalign(4096, (size + 4095) & ~(size_t) 4095);
+}
+
+size_t malloc_usable_size(void * ptr) {
+  if (ptr == NULL) return 0;
+  return usable_size(ptr);
+}
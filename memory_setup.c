@@ -3,20 +3,240 @@
  * @Author 02335 team
  * @date   September, 2024
  * @brief  Memory management skeleton.
- * 
+ *
 * This file contains low level initialization of memory. You should
  * not need to edit this file as part of the assignment.
  *
+ * By default the arena is the static memory[] array below. memory_setup()
+ * can instead back it with an anonymous mapping using huge pages, and
+ * prefault it, as selected by two environment variables:
+ *
+ *   SIMPLE_ARENA    = bss (default) | thp | hugetlb | file | shm
+ *   SIMPLE_PREFAULT = none (default) | populate | parallel
+ *   SIMPLE_HEAP     = path of the heap file (default simple.heap), or
+ *                     name of the shared memory object (e.g. /workers)
+ *
+ * thp maps a 2 MB aligned region and asks for transparent huge pages with
+ * madvise(MADV_HUGEPAGE). hugetlb uses explicit huge pages (MAP_HUGETLB) and
+ * falls back to thp if none are reserved. populate faults in the whole arena
+ * at setup (MAP_POPULATE/MADV_POPULATE_WRITE); parallel touches it from one
+ * thread per online CPU. The pages of a heap file or shared heap are never
+ * written by prefaulting: parallel uses MADV_POPULATE_WRITE for them, or reads
+ * them on kernels without it.
+ *
+ * file maps SIMPLE_HEAP shared, creating it with ALLOCATE_SIZE bytes if it does
+ * not exist, and sets memory_persistent. The allocator then keeps its blocks,
+ * and a root pointer, in the file: a later process mapping it finds the heap as
+ * it was left, at whatever address the mapping lands.
+ *
+ * shm does the same with the POSIX shared memory object SIMPLE_HEAP, or with an
+ * anonymous memfd if it is not set, and also sets memory_shared: processes that
+ * map the object, or are forked after the arena is set up, share one heap.
+ * If either cannot be mapped the process exits rather than use a private arena.
  */
 
+#define _GNU_SOURCE
 #include "mm.h"
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ALLOCATE_SIZE    32*1024*1024                 // 32 MB
 #define SKEW_SIZE        10
+#define HUGE_PAGE_SIZE   (2*1024*1024)
+#define MAX_PREFAULT_THREADS 64
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 static int8_t skew[SKEW_SIZE];                        // Misalignment
 static int8_t memory[ALLOCATE_SIZE];
 
-const uintptr_t memory_start =  (uintptr_t) memory;
-const uintptr_t memory_end   =  (uintptr_t) memory + ALLOCATE_SIZE;
+uintptr_t memory_start =  (uintptr_t) memory;
+uintptr_t memory_end   =  (uintptr_t) memory + ALLOCATE_SIZE;
+int memory_persistent = 0;
+int memory_shared = 0;
+
+enum prefault { PREFAULT_NONE, PREFAULT_POPULATE, PREFAULT_PARALLEL };
+
+/* A heap file or shared heap that cannot be mapped is an error, not a reason to
+ * carry on with a private arena that is lost at exit */
+static void fail(const char * msg) {
+  (void) !write(2, msg, strlen(msg));
+  exit(EXIT_FAILURE);
+}
+
+static int env_is(const char * name, const char * value) {
+  const char * s = getenv(name);
+  return s != NULL && strcmp(s, value) == 0;
+}
+
+/* Map a 2 MB aligned anonymous region of ALLOCATE_SIZE bytes backed by transparent huge pages */
+static void * map_thp(void) {
+  size_t len = ALLOCATE_SIZE + HUGE_PAGE_SIZE;
+  uint8_t * raw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  uint8_t * aligned;
+
+  if (raw == MAP_FAILED) return NULL;
+
+  /* Trim the slack so the arena starts and ends on a huge page boundary */
+  aligned = (uint8_t *) (((uintptr_t) raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t) (HUGE_PAGE_SIZE - 1));
+  if (aligned > raw) munmap(raw, aligned - raw);
+  if (aligned + ALLOCATE_SIZE < raw + len) munmap(aligned + ALLOCATE_SIZE, raw + len - aligned - ALLOCATE_SIZE);
+
+  madvise(aligned, ALLOCATE_SIZE, MADV_HUGEPAGE);
+  return aligned;
+}
+
+/* Map ALLOCATE_SIZE bytes of explicit (hugetlbfs) huge pages */
+static void * map_hugetlb(int populate) {
+  size_t len = (ALLOCATE_SIZE + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (populate ? MAP_POPULATE : 0);
+  void * p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+  return p == MAP_FAILED ? NULL : p;
+}
+
+/* Map a heap file or shared memory object, giving it ALLOCATE_SIZE bytes if it is
+ * empty. Stores its size in *len and closes fd */
+static void * map_shared_fd(int fd, size_t * len) {
+  struct stat st;
+  void * p;
+
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, ALLOCATE_SIZE) != 0)) {
+    close(fd);
+    return NULL;
+  }
+  *len = st.st_size ? (size_t) st.st_size : ALLOCATE_SIZE;
+  p = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);  // The mapping keeps the file
+  return p == MAP_FAILED ? NULL : p;
+}
+
+static void * map_file(size_t * len) {
+  const char * path = getenv("SIMPLE_HEAP");
+
+  if (path == NULL || *path == '\0') path = "simple.heap";
+  return map_shared_fd(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600), len);
+}
+
+static void * map_shm(size_t * len) {
+  const char * name = getenv("SIMPLE_HEAP");
+
+  if (name == NULL || *name == '\0') {
+    return map_shared_fd(memfd_create("simple_heap", MFD_CLOEXEC), len);
+  }
+  return map_shared_fd(shm_open(name, O_RDWR | O_CREAT, 0600), len);
+}
+
+struct prefault_slice {
+  volatile int8_t * start;
+  size_t len;
+  long page;
+  int write;                          // Store to the pages; a heap file or shared heap is only read
+};
+
+static void * prefault_worker(void * arg) {
+  struct prefault_slice * slice = arg;
+  size_t off;
+
+  for (off = 0; off < slice->len; off += slice->page) {
+    if (slice->write) {
+      slice->start[off] = 0;
+    } else {
+      (void) slice->start[off];
+    }
+  }
+  return NULL;
+}
+
+/* Touch every page of the arena, split across one thread per online CPU. The
+ * pages of a heap file or shared heap hold data, so they are read instead */
+static void prefault_parallel(void) {
+  pthread_t threads[MAX_PREFAULT_THREADS];
+  int started[MAX_PREFAULT_THREADS];
+  struct prefault_slice slices[MAX_PREFAULT_THREADS];
+  long page = sysconf(_SC_PAGESIZE);
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t len = memory_end - memory_start;
+  size_t chunk;
+  long i;
+
+  if (n < 1) n = 1;
+  if (n > MAX_PREFAULT_THREADS) n = MAX_PREFAULT_THREADS;
+  chunk = (len / n + page - 1) & ~(size_t) (page - 1);
+
+  for (i = 0; i < n; i++) {
+    size_t off = i * chunk;
+    slices[i].start = (int8_t *) memory_start + (off < len ? off : len);
+    slices[i].len = off >= len ? 0 : (len - off < chunk ? len - off : chunk);
+    slices[i].page = page;
+    slices[i].write = !memory_persistent;
+    started[i] = pthread_create(&threads[i], NULL, prefault_worker, &slices[i]) == 0;
+    if (!started[i]) prefault_worker(&slices[i]); // Do this slice ourselves
+  }
+  for (i = 0; i < n; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+  }
+}
+
+/**
+ * @name    memory_setup
+ * @brief   Select the backing of the arena and update memory_start/memory_end
+ *
+ * Called by simple_init before the block structure is built. Only the first
+ * call has any effect.
+ */
+void memory_setup(void) {
+  static int done = 0;
+  enum prefault prefault = PREFAULT_NONE;
+  void * arena = NULL;
+  size_t arena_size = ALLOCATE_SIZE;
+
+  if (done) return;
+  done = 1;
+
+  if (env_is("SIMPLE_PREFAULT", "populate")) prefault = PREFAULT_POPULATE;
+  if (env_is("SIMPLE_PREFAULT", "parallel")) prefault = PREFAULT_PARALLEL;
+
+  if (env_is("SIMPLE_ARENA", "file")) {
+    arena = map_file(&arena_size);
+    if (arena == NULL) fail("Cannot map the heap file\n");
+    memory_persistent = 1;
+  }
+  if (env_is("SIMPLE_ARENA", "shm")) {
+    arena = map_shm(&arena_size);
+    if (arena == NULL) fail("Cannot map the shared heap\n");
+    memory_persistent = memory_shared = 1;
+  }
+  if (env_is("SIMPLE_ARENA", "hugetlb")) {
+    arena = map_hugetlb(prefault == PREFAULT_POPULATE);
+  }
+  if (arena == NULL && (env_is("SIMPLE_ARENA", "hugetlb") || env_is("SIMPLE_ARENA", "thp"))) {
+    arena = map_thp();
+  }
+
+  if (arena != NULL) {
+    memory_start = (uintptr_t) arena;
+    memory_end   = (uintptr_t) arena + arena_size;
+  }
+
+  if (prefault == PREFAULT_POPULATE || (prefault == PREFAULT_PARALLEL && memory_persistent)) {
+    // MADV_POPULATE_WRITE faults the pages in writable without changing what they hold
+    uintptr_t page_start = memory_start & ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1);
+    if (madvise((void *) page_start, memory_end - page_start, MADV_POPULATE_WRITE) != 0) {
+      prefault = PREFAULT_PARALLEL; // Kernel without MADV_POPULATE_WRITE; touch the pages instead
+    } else {
+      prefault = PREFAULT_NONE;
+    }
+  }
+
+  if (prefault == PREFAULT_PARALLEL) prefault_parallel();
+}
@@ -4,33 +4,410 @@
  * @date   September, 2024
  * @brief  Memory management skeleton.
  * 
+ * Build options:
+ *   MM_SILENT    No allocation trace on stdout
+ *   MM_OOB_META  Keep block headers in a separate array instead of in front of each block
+ *
+ * SIMPLE_GUARD_SAMPLE=N in the environment puts about one in N blocks between
+ * guard pages to catch overflows and uses after free (see mm_guard.c).
+ * SIMPLE_HEAP_MAP=path writes a heap map (see mm.h) to path at exit.
+ *
+ * Blocks form a circular list in address order ending in an allocated dummy
+ * block. Headers are 32 bit offsets with a free and a previous-free flag;
+ * free blocks carry a footer so simple_free can merge in both directions.
+ *
+ * Links never hold addresses, only offsets (or chunk numbers) from the start of
+ * the arena, so a heap in a mapped file (SIMPLE_ARENA=file, see memory_setup.c)
+ * can be mapped again at any address and used as it is. The same holds for a
+ * heap in shared memory (SIMPLE_ARENA=shm), which several processes use at once
+ * under a robust process-shared mutex.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>   // open() for heap maps
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>  // kill() to find a formatter that died
 #include <stdint.h>
-#include <stdlib.h>  // Only included for EXIT_FAILURE
+#include <stdlib.h>  // Only included for EXIT_FAILURE, atexit, getenv and abort
+#include <string.h>  // memset() for the block map
+#include <unistd.h>  // write() for the out of memory message
+#include <sys/mman.h> // msync() for heap files
 
 #include "mm.h"
+#include "io.h"
 
-extern const uintptr_t memory_start;
-extern const uintptr_t memory_end;
+extern uintptr_t memory_start;
+extern uintptr_t memory_end;
 
 /* Proposed data structure elements */
 
+/* Flag bits kept in the low bits of a header's next field */
+#define FLAG_FREE       0x1   // Block is free
+#define FLAG_PREV_FREE  0x2   // Block in front of this one is free (and ends with a footer)
+
+#ifndef MM_OOB_META
+
+/* Compact headers: one 32 bit word in front of each block holding the offset
+ * of the next header from heap_base, with the flags in the low bits. Headers
+ * sit 4 bytes below a 16 byte boundary, so user blocks are aligned for any
+ * type (alignof(max_align_t), as malloc guarantees), every header offset is a
+ * multiple of 16 and block sizes are 12 modulo 16. Arenas are limited to 4 GB. */
+
 typedef struct header {
-  struct header * next;     // Bit 0 is used to indicate free block 
-  uint64_t user_block[0];   // Standard trick: Empty array to make sure start of user block is aligned
+  uint32_t next;            // Offset of next header from heap_base | flags
+  uint32_t user_block[0];   // User memory follows the 4 byte header
 } BlockHeader;
 
-/* Macros to handle the free flag at bit 0 of the next pointer of header pointed at by p */
-#define GET_NEXT(p)    (void *)((uintptr_t)(p->next) & ~0x1)  // Mask out the least significant bit to get the actual pointer
-#define SET_NEXT(p, n) p->next = (void *)((uintptr_t)(n) | ((uintptr_t)(p->next) & 0x1))  // Preserve the free flag
-#define GET_FREE(p)    (uint8_t)((uintptr_t)(p->next) & 0x1)  // Get the least significant bit to determine free status
-#define SET_FREE(p, f) p->next = (void *)(((uintptr_t)(p->next) & ~0x1) | (f & 0x1))  // Set or clear the free flag
+static uintptr_t heap_base = 0;       // Address of the first header, offsets are relative to it
+
+#define FLAG_MASK      0x7
+#define GET_NEXT(p)    (void *)(heap_base + ((p)->next & ~FLAG_MASK))  // Mask out the flags to get the offset
+#define SET_NEXT(p, n) (p)->next = (uint32_t)((uintptr_t)(n) - heap_base) | ((p)->next & FLAG_MASK)  // Preserve the flags
 #define SIZE(p)        (size_t)((uintptr_t)GET_NEXT(p) - (uintptr_t)(p) - sizeof(BlockHeader))  // Calculate block size
-#define MIN_SIZE (8)   // A block should have at least 8 bytes available for the user
+#define MIN_SIZE (12)  // Smallest size that is 12 modulo 16 and has room for a footer
+
+/* Mapping between headers and user memory */
+#define ALIGNMENT        16                                                       // Alignment of user blocks
+#define ALIGN_SIZE(n)    ((((n) + sizeof(BlockHeader) + 15) & ~(size_t)15) - sizeof(BlockHeader))  // Round up to 12 modulo 16
+#define BLOCK_OVERHEAD   sizeof(BlockHeader)                                      // Bytes a split costs besides user data
+#define BLOCK_DATA(p)    ((void *)(p)->user_block)                                // User memory of block p
+#define DATA_BLOCK(ptr)  ((BlockHeader *)((uintptr_t)(ptr) - sizeof(BlockHeader))) // Block owning user pointer ptr
+#define BLOCK_AFTER(p, n) ((BlockHeader *)((uintptr_t)BLOCK_DATA(p) + (n)))       // Block starting n user bytes into p
+#define BLOCK_BEFORE(p, n) ((BlockHeader *)((uintptr_t)(p) - (n) - sizeof(BlockHeader))) // Block of n user bytes ending at p
+#define VALID_BLOCK(p)   ((uintptr_t)(p) >= memory_start && (uintptr_t)(p) < memory_end)
+
+/* A free block ends with a footer holding its own header offset */
+#define SET_FOOTER(p)    (((uint32_t *)GET_NEXT(p))[-1] = (uint32_t)((uintptr_t)(p) - heap_base))
+#define PREV_BLOCK(p)    ((BlockHeader *)(heap_base + ((uint32_t *)(p))[-1]))     // Free block in front of p
+
+#else
+
+/* Out-of-band metadata: the arena is split into a compact array of 32 bit
+ * headers, one per CHUNK_SIZE bytes of user memory, followed by the user
+ * memory itself. Header i describes the block whose data starts at chunk i;
+ * next holds the chunk number of the following block above the flag bits.
+ * Headers of chunks inside a block are unused, except that the last one of
+ * a free block is its footer. The search loop thus only reads the dense
+ * header array, and user overruns cannot reach it. */
+
+typedef struct header {
+  uint32_t next;            // (chunk number of next block << 2) | flags
+} BlockHeader;
+
+#define CHUNK_SIZE     (16)
+
+static BlockHeader * meta = NULL;     // Header array, indexed by chunk number
+static uintptr_t data_start = 0;      // Address of chunk 0
+
+#define FLAG_MASK      0x3
+#define GET_NEXT(p)    (void *)(meta + ((p)->next >> 2))
+#define SET_NEXT(p, n) (p)->next = (uint32_t)((((BlockHeader *)(n) - meta) << 2) | ((p)->next & FLAG_MASK))
+#define SIZE(p)        (size_t)(((BlockHeader *)GET_NEXT(p) - (p)) * CHUNK_SIZE)
+#define MIN_SIZE (CHUNK_SIZE)
+
+#define ALIGNMENT        CHUNK_SIZE
+#define ALIGN_SIZE(n)    (((n) + CHUNK_SIZE - 1) & ~(size_t)(CHUNK_SIZE - 1))
+#define BLOCK_OVERHEAD   0
+#define BLOCK_DATA(p)    ((void *)(data_start + (uintptr_t)((p) - meta) * CHUNK_SIZE))
+#define DATA_BLOCK(ptr)  (meta + ((uintptr_t)(ptr) - data_start) / CHUNK_SIZE)
+#define BLOCK_AFTER(p, n) ((p) + (n) / CHUNK_SIZE)
+#define BLOCK_BEFORE(p, n) ((p) - (n) / CHUNK_SIZE)
+#define VALID_BLOCK(p)   ((p) >= meta && (uintptr_t)BLOCK_DATA(p) <= memory_end)
+
+/* The footer of a free block is the header of its last chunk, holding the block's
+ * chunk number. A one chunk block is its own footer, recognised by pointing at p. */
+#define SET_FOOTER(p)    ((BlockHeader *)GET_NEXT(p) - 1)->next = (SIZE(p) > CHUNK_SIZE ? (uint32_t)(((p) - meta) << 2) : (p)->next)
+#define PREV_BLOCK(p)    ((BlockHeader *)GET_NEXT((p) - 1) == (p) ? (p) - 1 : (BlockHeader *)GET_NEXT((p) - 1))
+
+#endif
+
+/* No block is larger than the arena. Larger requests are refused before ALIGN_SIZE,
+ * which would wrap around for sizes close to SIZE_MAX */
+#define MAX_REQUEST      (memory_end - memory_start)
+
+/* Macros to handle the flags of the header pointed at by p */
+#define GET_FREE(p)         (uint8_t)((p)->next & FLAG_FREE)  // Get the least significant bit to determine free status
+#define SET_FREE(p, f)      (p)->next = ((p)->next & ~FLAG_FREE) | ((f) & 0x1)  // Set or clear the free flag
+#define GET_PREV_FREE(p)    (uint8_t)(((p)->next & FLAG_PREV_FREE) >> 1)
+#define SET_PREV_FREE(p, f) (p)->next = ((p)->next & ~FLAG_PREV_FREE) | (((f) & 0x1) << 1)
+
+/* Allocation tracing. write_fmt never allocates, so tracing cannot recurse into
+ * the allocator; builds that must stay quiet (e.g. the LD_PRELOAD shim) define MM_SILENT. */
+#ifdef MM_SILENT
+#define MM_TRACE(...)  ((void)0)
+#else
+#define MM_TRACE(...)  write_fmt(__VA_ARGS__)
+#endif
 
 static BlockHeader * first = NULL;
 static BlockHeader * current = NULL;
+static BlockHeader * last = NULL;        // Dummy block at the end of the arena
+
+/* The heap is split into a short-lived region from first up to top and a
+ * long-lived region from top to the dummy block, which starts out empty. Blocks
+ * allocated with SIMPLE_LONG_LIVED reuse holes of the long-lived region, found
+ * next-fit from long_current, or are carved off the end of the wilderness, so the
+ * region grows downwards. SIMPLE_SHORT_LIVED blocks reuse holes below the
+ * wilderness before splitting it, which keeps them packed at the start of the
+ * heap. Other allocations search the short-lived region as before and go to the
+ * long-lived one only when nothing fits. Long-lived blocks thus do not end up
+ * between short-lived ones and keep their holes from merging.
+ *
+ * The wilderness is the free block in front of top (NULL when that block is in
+ * use). While no other free block can hold a request it is served by splitting
+ * it directly, like a bump allocator, without walking the list. */
+#define LONG_SEARCH_LIMIT 64             // Blocks a long-lived request looks at for a hole
+
+static BlockHeader * top = NULL;
+static BlockHeader * long_current = NULL;
+static BlockHeader * wilderness = NULL;
+static size_t hole_count = 0;            // Free blocks other than the wilderness
+static size_t hole_max = 0;              // Upper bound on the size of those in the short-lived region
+static size_t long_hole_max = 0;         // Upper bound on the size of those in the long-lived region
+
+/* The block map has a bit for every ALIGNMENT bytes of user memory from
+ * map_base, set where the data of a block in use starts. simple_free and
+ * simple_usable_size check a pointer with one bit test instead of trusting the
+ * header in front of it, and simple_block_start finds the block holding an
+ * interior pointer by looking for the nearest bit at or below it. A summary
+ * with a bit per map word (set if the word is not 0) lets that search skip 4096
+ * bits at a time.
+ *
+ * Both live at the start of the arena (behind the superblock), so a heap file or
+ * shared heap keeps them with its blocks. They cost 1/64 of the arena (1/128
+ * with MM_OOB_META). */
+static uint64_t * block_map = NULL;
+static uint64_t * block_summary = NULL;
+static uintptr_t map_base = 0;           // User memory of the first block
+static size_t map_words = 0;             // Words in block_map; the summary has map_words / 64 rounded up
+
+#define MAP_INDEX(ptr)    (((uintptr_t)(ptr) - map_base) / ALIGNMENT)
+#define MAP_BIT(i)        ((uint64_t)1 << ((i) & 63))
+#define MAP_HOLDS(ptr)    ((uintptr_t)(ptr) - map_base < map_words * 64 * ALIGNMENT && ((uintptr_t)(ptr) - map_base) % ALIGNMENT == 0)
+#define IN_USE_AT(ptr)    (MAP_HOLDS(ptr) && (block_map[MAP_INDEX(ptr) >> 6] & MAP_BIT(MAP_INDEX(ptr))))
+
+/* Record that the block with user memory at ptr is in use, or no longer in use */
+static inline void map_set(void *ptr) {
+    size_t i = MAP_INDEX(ptr);
+
+    block_map[i >> 6] |= MAP_BIT(i);
+    block_summary[i >> 12] |= MAP_BIT(i >> 6);
+}
+
+static inline void map_clear(void *ptr) {
+    size_t i = MAP_INDEX(ptr);
+
+    if ((block_map[i >> 6] &= ~MAP_BIT(i)) == 0) block_summary[i >> 12] &= ~MAP_BIT(i >> 6);
+}
+
+/* Index of the highest bit set at or below bit i, or -1 if there is none */
+static long map_find_before(size_t i) {
+    size_t w = i >> 6;
+    uint64_t bits = block_map[w] & (~(uint64_t)0 >> (63 - (i & 63)));
+    size_t s;
+
+    if (bits != 0) return (long)(w * 64 + 63 - __builtin_clzll(bits));
+    if (w == 0) return -1;
+
+    // Look for the highest nonempty map word below w in the summary
+    s = (w - 1) >> 6;
+    bits = block_summary[s] & (~(uint64_t)0 >> (63 - ((w - 1) & 63)));
+    while (bits == 0) {
+        if (s == 0) return -1;
+        bits = block_summary[--s];
+    }
+    w = s * 64 + 63 - __builtin_clzll(bits);
+    return (long)(w * 64 + 63 - __builtin_clzll(block_map[w]));
+}
+
+/* A heap file starts with a HeapSuper holding the root pointer and, as of the
+ * last simple_heap_sync, the state above, all as offsets from memory_start
+ * (0 for NULL). Every change to the blocks clears clean first, so a heap that
+ * was not synced after its last change has its state rebuilt by walking the
+ * blocks when it is opened. Without a heap file super points at a static copy,
+ * which keeps the root and spares the hot paths a test.
+ *
+ * In a shared heap the superblock is the only copy of the state that counts:
+ * every call takes lock, loads the state into the variables above and saves it
+ * back before unlocking. The first process to map a new heap formats it while
+ * the others wait for the magic number to appear. */
+
+#define HEAP_MAGIC  0x3170616548706d53ULL   // "SmpHeap1"
+
+#ifndef MM_OOB_META
+#define HEAP_LAYOUT 5               // 1 and 2 had no block map, 3 was 8 byte aligned
+#else
+#define HEAP_LAYOUT 4
+#endif
+
+typedef struct heap_super {
+  uint64_t magic;           // HEAP_MAGIC once the heap is formatted
+  uint64_t size;            // memory_end - memory_start
+  uint32_t layout;          // HEAP_LAYOUT of the build that formatted it
+  uint32_t clean;           // The fields below match the blocks
+  uint64_t root;            // Offset of the root block's data
+  uint64_t current;
+  uint64_t wilderness;
+  uint64_t top;
+  uint64_t long_current;
+  uint64_t hole_count;
+  uint64_t hole_max;
+  uint64_t long_hole_max;
+  uint32_t formatting;      // Pid of the process formatting a shared heap
+  pthread_mutex_t lock;     // Robust and process-shared, for shared heaps
+} HeapSuper;
+
+static HeapSuper static_super;
+static HeapSuper * super = &static_super;
+
+#define TO_OFFSET(p)    ((p) == NULL ? 0 : (uint64_t)((uintptr_t)(p) - memory_start))
+#define FROM_OFFSET(o)  ((o) == 0 ? NULL : (void *)(memory_start + (o)))
+
+static void load_state(void) {
+    current = FROM_OFFSET(super->current);
+    wilderness = FROM_OFFSET(super->wilderness);
+    top = FROM_OFFSET(super->top);
+    long_current = FROM_OFFSET(super->long_current);
+    hole_count = super->hole_count;
+    hole_max = super->hole_max;
+    long_hole_max = super->long_hole_max;
+}
+
+static void save_state(void) {
+    super->current = TO_OFFSET(current);
+    super->wilderness = TO_OFFSET(wilderness);
+    super->top = TO_OFFSET(top);
+    super->long_current = TO_OFFSET(long_current);
+    super->hole_count = hole_count;
+    super->hole_max = hole_max;
+    super->long_hole_max = long_hole_max;
+    super->clean = 1;
+}
+
+/* Derive the state and the block map from the blocks themselves, for a heap whose saved state
+ * is stale. The highest free block becomes the wilderness and everything above it the long-lived region */
+static void rebuild_state(void) {
+    BlockHeader *p;
+
+    current = first;
+    wilderness = NULL;
+    hole_count = 0;
+    hole_max = 0;
+    memset(block_map, 0, (map_words + (map_words + 63) / 64) * sizeof(uint64_t));
+    for (p = first; p != last; p = GET_NEXT(p)) {
+        if (!GET_FREE(p)) {
+            map_set(BLOCK_DATA(p));
+            continue;
+        }
+        if (wilderness != NULL) {
+            hole_count++;
+            if (SIZE(wilderness) > hole_max) hole_max = SIZE(wilderness);
+        }
+        wilderness = p;
+    }
+    top = wilderness != NULL ? GET_NEXT(wilderness) : last;
+    long_current = top;
+    long_hole_max = hole_max;
+}
+
+/* Take the lock of a shared heap and load its state */
+static void lock_heap(void) {
+    if (pthread_mutex_lock(&super->lock) == EOWNERDEAD) {
+        // The owner died inside the allocator, so the saved state may be stale
+        rebuild_state();
+        save_state();
+        pthread_mutex_consistent(&super->lock);
+    } else {
+        load_state();
+    }
+}
+
+static void unlock_heap(void) {
+    save_state();
+    pthread_mutex_unlock(&super->lock);
+}
+
+/**
+ * @name    claim_format
+ * @brief   Decide whether this process formats the heap in the mapped superblock
+ *
+ * A heap file is formatted unless it already holds a heap. For a shared heap one
+ * process wins the formatting by storing its pid; the others wait until it is done,
+ * or take the formatting over if that process died before finishing it.
+ *
+ * @retval 1 if the caller must format the heap, 0 if it is ready to use.
+ */
+static int claim_format(void) {
+    uint32_t self = (uint32_t)getpid();
+    uint32_t owner = 0;
+
+    if (__atomic_load_n(&super->magic, __ATOMIC_ACQUIRE) == HEAP_MAGIC) return 0;
+    if (!memory_shared) return 1;
+    while (!__atomic_compare_exchange_n(&super->formatting, &owner, self, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        if (__atomic_load_n(&super->magic, __ATOMIC_ACQUIRE) == HEAP_MAGIC) return 0;
+        if (kill((pid_t)owner, 0) != 0 && errno == ESRCH) continue; // Retry with the dead owner expected
+        sched_yield();
+        owner = 0;
+    }
+    return 1;
+}
+
+/**
+ * @name    open_heap
+ * @brief   Take over the blocks of a heap formatted by another process
+ *
+ * A heap file gets its allocator state from the superblock if it was synced after
+ * the last change, and otherwise by one walk over the blocks. A shared heap loads
+ * it on every call instead.
+ */
+static void open_heap(void) {
+    if (super->size != memory_end - memory_start || super->layout != HEAP_LAYOUT) {
+        // Never format over a heap that was made by another build
+        static const char msg[] = "Heap file does not match this allocator\n";
+        (void)!write(2, msg, sizeof(msg) - 1);
+        exit(EXIT_FAILURE);
+    }
+    if (memory_shared) return;
+
+    if (super->clean) {
+        load_state();
+    } else {
+        rebuild_state();
+    }
+    super->clean = 0;
+    atexit(simple_heap_sync);
+}
+
+/* Set up the superblock of a freshly formatted heap file or shared heap */
+static void format_super(void) {
+    pthread_mutexattr_t attr;
+
+    super->size = memory_end - memory_start;
+    super->layout = HEAP_LAYOUT;
+    super->root = 0;
+    if (memory_shared) {
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&super->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        save_state();
+    } else {
+        super->clean = 0;
+        atexit(simple_heap_sync);
+    }
+    __atomic_store_n(&super->magic, HEAP_MAGIC, __ATOMIC_RELEASE);
+}
+
+/* Sampled guard pages */
+
+#include "mm_guard.c"
+
+static void heap_map_at_exit(void);  // In mm_aux.c
+
 
 /**
  * @name    simple_init
@@ -38,27 +415,245 @@ static BlockHeader * current = NULL;
  *
  */
 void simple_init() {
-    uintptr_t aligned_memory_start = (memory_start + 7) & ~0x7; // Align to 8 bytes
-    uintptr_t aligned_memory_end = memory_end; // No need to align the end
+    if (first == NULL) memory_setup(); // Pick the arena backing before using its bounds
 
     if (first == NULL) {
-        if (aligned_memory_start + sizeof(BlockHeader) + MIN_SIZE <= aligned_memory_end) {
+        uintptr_t arena_start = memory_start; // Blocks start behind the superblock of a heap file
+
+        if (memory_persistent) {
+            super = (HeapSuper *)memory_start;
+            arena_start += sizeof(HeapSuper);
+        }
+
+        // The block map comes next, sized for all of the rest (a few bits too many)
+        arena_start = (arena_start + 7) & ~(uintptr_t)0x7;
+        if (arena_start < memory_end) {
+            map_words = ((memory_end - arena_start) / ALIGNMENT + 63) / 64;
+            block_map = (uint64_t *)arena_start;
+            block_summary = block_map + map_words;
+            arena_start += (map_words + (map_words + 63) / 64) * sizeof(uint64_t);
+        }
+#ifndef MM_OOB_META
+        heap_base = ((arena_start + sizeof(BlockHeader) + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1)) - sizeof(BlockHeader); // User blocks ALIGNMENT aligned
+
+        if (heap_base + 2 * sizeof(BlockHeader) + MIN_SIZE <= memory_end) {
+            uintptr_t span = (memory_end - sizeof(BlockHeader) - heap_base) & ~(uintptr_t)(ALIGNMENT - 1);
+            if (span > UINT32_MAX - FLAG_MASK) span = (UINT32_MAX - FLAG_MASK) & ~(uintptr_t)(ALIGNMENT - 1); // Offsets are 32 bit
+
+            first = (BlockHeader *)heap_base;
+            last = (BlockHeader *)(heap_base + span);
+            map_base = (uintptr_t)BLOCK_DATA(first);
+        }
+#else
+        uintptr_t aligned_memory_start = (arena_start + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1);
+
+        if (aligned_memory_start + 2 * sizeof(BlockHeader) + 2 * CHUNK_SIZE <= memory_end) {
+            // n chunks need n + 1 headers (one for the dummy block) plus alignment slack
+            size_t chunks = (memory_end - aligned_memory_start - 2 * CHUNK_SIZE) / (CHUNK_SIZE + sizeof(BlockHeader));
+
+            meta = (BlockHeader *)aligned_memory_start;
+            data_start = (aligned_memory_start + (chunks + 1) * sizeof(BlockHeader) + CHUNK_SIZE - 1) & ~(uintptr_t)(CHUNK_SIZE - 1);
+            first = meta;
+            last = meta + chunks;
+            map_base = data_start;
+        }
+#endif
+
+        if (first != NULL && memory_persistent && !claim_format()) {
+            open_heap(); // The blocks are already there
+        } else if (first != NULL) {
             // Initialize the first block
-            first = (BlockHeader *)aligned_memory_start;
-            SET_NEXT(first, (BlockHeader *)(aligned_memory_end - sizeof(BlockHeader))); // Last block
+            first->next = 0;
+            SET_NEXT(first, last); // Last block
             SET_FREE(first, 1); // Mark the first block as free
 
             // Initialize the last block (dummy block)
-            BlockHeader *last = (BlockHeader *)(aligned_memory_end - sizeof(BlockHeader));
+            last->next = 0;
             SET_NEXT(last, first); // Circular reference to first block
             SET_FREE(last, 0); // Last block is always considered allocated
+            SET_PREV_FREE(last, 1);
+            SET_FOOTER(first);
+
+            if (memory_persistent) {
+                // The file may hold anything; a fresh arena is zero already
+                memset(block_map, 0, (map_words + (map_words + 63) / 64) * sizeof(uint64_t));
+            }
 
             current = first; // Set the current pointer to the first block
+            wilderness = first; // Everything is fresh memory
+            top = last; // No long-lived blocks yet
+            long_current = last;
+
+            if (memory_persistent) format_super();
         } else {
-            fprintf(stderr, "Not enough memory to initialize\n");
+            static const char msg[] = "Not enough memory to initialize\n";
+            (void)!write(2, msg, sizeof(msg) - 1);
             exit(EXIT_FAILURE);
         }
+        if (!memory_persistent) guard_setup(); // Guard slots are private to the process
+        if (getenv("SIMPLE_HEAP_MAP") != NULL) atexit(heap_map_at_exit);
+    }
+}
+
+
+/**
+ * @name    allocate_block
+ * @brief   Mark the free block as used, splitting off the rest if it is large enough.
+ *
+ * @param BlockHeader *block Free block with at least aligned_size bytes.
+ * @param size_t aligned_size Aligned number of bytes requested.
+ * @retval Pointer to the user memory of block.
+ *
+ */
+
+static void* allocate_block(BlockHeader *block, size_t aligned_size) {
+    size_t block_size = SIZE(block);
+    BlockHeader *rest = NULL;
+
+    super->clean = 0;
+
+    // Check if we can split the block
+    if (block_size - aligned_size >= BLOCK_OVERHEAD + MIN_SIZE) {
+        rest = BLOCK_AFTER(block, aligned_size);
+        rest->next = 0;
+        SET_NEXT(rest, GET_NEXT(block));
+        SET_FREE(rest, 1); // New block is free
+        SET_FOOTER(rest);
+
+        SET_NEXT(block, rest); // Update block to point to the new block
+        SET_FREE(block, 0); // Mark the block as used
+        MM_TRACE("Allocating %zu bytes at %p\n", aligned_size, BLOCK_DATA(block)); // Print when allocating
+    } else {
+        SET_FREE(block, 0); // Mark the block as used
+        SET_PREV_FREE((BlockHeader *)GET_NEXT(block), 0);
+        MM_TRACE("Allocating %zu bytes at %p (no split)\n", aligned_size, BLOCK_DATA(block)); // Print when allocating without splitting
+    }
+
+    map_set(BLOCK_DATA(block));
+    if (block == wilderness) {
+        wilderness = rest; // The wilderness shrinks, or is used up
+    } else if (rest == NULL && --hole_count == 0) {
+        hole_max = 0;
+        long_hole_max = 0;
+    }
+
+    return BLOCK_DATA(block);
+}
+
+
+/**
+ * @name    allocate_top
+ * @brief   Allocate a long-lived block from the end of the wilderness, growing the long-lived region.
+ *
+ * @param size_t aligned_size Aligned number of bytes requested, at most the size of the wilderness.
+ * @retval Pointer to the user memory of the new block.
+ *
+ */
+
+static void* allocate_top(size_t aligned_size) {
+    BlockHeader *block;
+
+    if (SIZE(wilderness) - aligned_size < BLOCK_OVERHEAD + MIN_SIZE) {
+        return allocate_block(wilderness, aligned_size); // Too small to split, use all of it
+    }
+
+    super->clean = 0;
+    block = BLOCK_BEFORE(top, aligned_size);
+    block->next = 0;
+    SET_NEXT(block, top);
+    SET_PREV_FREE(block, 1); // The wilderness stays in front of it
+    SET_PREV_FREE(top, 0);
+    SET_NEXT(wilderness, block);
+    SET_FOOTER(wilderness);
+    top = block;
+    map_set(BLOCK_DATA(block));
+    MM_TRACE("Allocating %zu bytes at %p\n", aligned_size, BLOCK_DATA(block));
+
+    return BLOCK_DATA(block);
+}
+
+
+/**
+ * @name    search_region
+ * @brief   Next-fit search of the blocks from start up to end, beginning at *rover.
+ *
+ * @param BlockHeader **rover Search pointer of the region, moved to just after the block found.
+ * @param BlockHeader *start First block of the region.
+ * @param BlockHeader *end First block after the region.
+ * @param size_t aligned_size Aligned number of bytes requested.
+ * @param size_t limit Number of blocks to look at before giving up, 0 for a full round.
+ * @param size_t *largest Raised to the size of the largest hole seen.
+ * @retval Pointer to the user memory of the allocated block, or NULL if none was found.
+ *
+ */
+
+static void* search_region(BlockHeader **rover, BlockHeader *start, BlockHeader *end, size_t aligned_size,
+                           size_t limit, size_t *largest) {
+    BlockHeader *search_start;
+
+    if (start == end) return NULL;
+    if (*rover < start || *rover >= end) *rover = start; // Left behind by a move of top
+    search_start = *rover;
+
+    do {
+        if (GET_FREE(*rover)) {
+            size_t block_size = SIZE(*rover);
+
+            // Check if the free block is large enough
+            if (block_size >= aligned_size) {
+                void *allocated_memory = allocate_block(*rover, aligned_size);
+                *rover = GET_NEXT(*rover); // Continue after it next time
+                return allocated_memory;
+            }
+            if (*rover != wilderness && block_size > *largest) *largest = block_size;
+        }
+        *rover = GET_NEXT(*rover); // Move to the next block
+        if (*rover == end) *rover = start;
+    } while (*rover != search_start && --limit != 0); // Loop until we return to the starting block
+
+    return NULL;
+}
+
+
+/**
+ * @name    heap_malloc
+ * @brief   Allocate at least size contiguous bytes of an initialized heap (locked if shared).
+ *
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ *
+ */
+
+static void* heap_malloc(size_t size) {
+    if (size > MAX_REQUEST) {
+        MM_TRACE("Allocation failed for %zu bytes\n", size);
+        return NULL;
+    }
+    size_t aligned_size = ALIGN_SIZE(size); // Align requested size
+    if (aligned_size < MIN_SIZE) aligned_size = MIN_SIZE;
+
+    void *allocated_memory = NULL;
+    size_t largest_hole = 0;
+
+    if (hole_max >= aligned_size) {
+        allocated_memory = search_region(&current, first, top, aligned_size, 0, &largest_hole);
+        if (allocated_memory == NULL) hole_max = largest_hole; // Every block was visited, so the bound is now exact
+    } else if (wilderness != NULL && SIZE(wilderness) >= aligned_size) {
+        // Fast path: no other free block is large enough, so only the wilderness can serve the request
+        allocated_memory = allocate_block(wilderness, aligned_size);
+    }
+
+    if (allocated_memory == NULL && long_hole_max >= aligned_size) {
+        // Nothing fits among the short-lived blocks, so spill into the long-lived region
+        largest_hole = 0;
+        allocated_memory = search_region(&long_current, top, last, aligned_size, 0, &largest_hole);
+        if (allocated_memory == NULL) long_hole_max = largest_hole;
     }
+
+    if (allocated_memory == NULL) {
+        MM_TRACE("Allocation failed for %zu bytes\n", aligned_size); // Print if allocation fails
+    }
+    return allocated_memory;
 }
 
 
@@ -74,77 +669,396 @@ void simple_init() {
  */
 
 void* simple_malloc(size_t size) {
+    void *ptr;
+
     if (first == NULL) {
         simple_init(); // Initialize memory if not already done
         if (first == NULL) return NULL;
     }
+    if (guard_countdown != 0 && --guard_countdown == 0) {
+        ptr = guard_malloc(size, __builtin_return_address(0));
+        if (ptr != NULL) return ptr;
+    }
+    if (!memory_shared) return heap_malloc(size);
 
-    size_t aligned_size = (size + 7) & ~0x7; // Align requested size
-    BlockHeader *search_start = current;
+    lock_heap();
+    ptr = heap_malloc(size);
+    unlock_heap();
+    return ptr;
+}
 
-    do {
-        if (GET_FREE(current)) {
-            size_t block_size = SIZE(current);
 
-            // Check if the free block is large enough
-            if (block_size >= aligned_size) {
-                // Check if we can split the block
-                if (block_size - aligned_size >= sizeof(BlockHeader) + MIN_SIZE) {
-                    BlockHeader *new_block = (BlockHeader *)((uintptr_t)current + sizeof(BlockHeader) + aligned_size);
-                    SET_NEXT(new_block, GET_NEXT(current));
-                    SET_FREE(new_block, 1); // New block is free
-
-                    SET_NEXT(current, new_block); // Update current block to point to the new block
-                    SET_FREE(current, 0); // Mark the current block as used
-                    printf("Allocating %zu bytes at %p\n", aligned_size, (void*)current->user_block); // Print when allocating
-                } else {
-                    SET_FREE(current, 0); // Mark the current block as used
-                    printf("Allocating %zu bytes at %p (no split)\n", aligned_size, (void*)current->user_block); // Print when allocating without splitting
-                }
-
-                void *allocated_memory = (void *)(current->user_block); // Return pointer to user block
-                current = GET_NEXT(current); // Update current to the next block
-                return allocated_memory;
-            }
-        }
-        current = GET_NEXT(current); // Move to the next block
-    } while (current != search_start); // Loop until we return to the starting block
-    
-    printf("Allocation failed for %zu bytes\n", aligned_size); // Print if allocation fails
-    return NULL; // No suitable block found
+/**
+ * @name    heap_malloc_short
+ * @brief   Allocate a short-lived block of an initialized heap (locked if shared).
+ *
+ * Searches the holes below the wilderness before splitting it, so short-lived
+ * blocks stay at the start of the heap instead of sweeping through it.
+ *
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ *
+ */
+
+static void* heap_malloc_short(size_t size) {
+    if (size > MAX_REQUEST) return heap_malloc(size);
+    size_t aligned_size = ALIGN_SIZE(size);
+    if (aligned_size < MIN_SIZE) aligned_size = MIN_SIZE;
+
+    if (hole_max >= aligned_size) {
+        size_t largest = 0;
+        void *allocated_memory = search_region(&current, first, wilderness != NULL ? wilderness : top, aligned_size, 0, &largest);
+
+        if (allocated_memory != NULL) return allocated_memory;
+        hole_max = largest;
+    }
+    if (wilderness != NULL && SIZE(wilderness) >= aligned_size) {
+        return allocate_block(wilderness, aligned_size);
+    }
+    return heap_malloc(size);
 }
 
 
 /**
- * @name    simple_free
- * @brief   Frees previously allocated memory and makes it available for subsequent calls to simple_malloc
+ * @name    heap_malloc_long
+ * @brief   Allocate a long-lived block of an initialized heap (locked if shared).
  *
- * This function should behave similar to a normal free implementation. 
+ * Takes it from a hole of the long-lived region among the next LONG_SEARCH_LIMIT
+ * blocks, or else from the end of the wilderness, and otherwise from wherever
+ * heap_malloc finds room. The region is full of small blocks, so a full search
+ * would cost more than the memory it saves.
  *
- * @param void *ptr Pointer to the memory to free.
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
  *
  */
 
-void simple_free(void* ptr) {
-    if (ptr == NULL) return;
+static void* heap_malloc_long(size_t size) {
+    if (size > MAX_REQUEST) return heap_malloc(size);
+    size_t aligned_size = ALIGN_SIZE(size);
+    if (aligned_size < MIN_SIZE) aligned_size = MIN_SIZE;
 
-    BlockHeader *block = (BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader));
+    if (long_hole_max >= aligned_size) {
+        size_t largest = 0;
+        void *allocated_memory = search_region(&long_current, top, last, aligned_size, LONG_SEARCH_LIMIT, &largest);
 
-    if (GET_FREE(block)) {
-        return; // Already free
+        if (allocated_memory != NULL) return allocated_memory;
+    }
+    if (wilderness != NULL && SIZE(wilderness) >= aligned_size) {
+        return allocate_top(aligned_size);
     }
+    return heap_malloc(size);
+}
+
+
+/**
+ * @name    simple_malloc_hint
+ * @brief   Allocate like simple_malloc, placing the block by its expected lifetime.
+ *
+ * SIMPLE_LONG_LIVED blocks are kept together at the end of the heap and
+ * SIMPLE_SHORT_LIVED ones at the start, so the holes that short-lived blocks
+ * leave behind are not pinned apart by long-lived ones and can merge again.
+ * Without a hint the block is allocated like simple_malloc.
+ *
+ * @param size_t size Number of bytes to allocate.
+ * @param int hint SIMPLE_SHORT_LIVED or SIMPLE_LONG_LIVED.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ *
+ */
 
+void* simple_malloc_hint(size_t size, int hint) {
+    void *ptr;
+
+    if (!(hint & (SIMPLE_SHORT_LIVED | SIMPLE_LONG_LIVED))) return simple_malloc(size);
+    if (first == NULL) {
+        simple_init();
+        if (first == NULL) return NULL;
+    }
+    if (guard_countdown != 0 && --guard_countdown == 0) {
+        ptr = guard_malloc(size, __builtin_return_address(0));
+        if (ptr != NULL) return ptr;
+    }
+    if (!memory_shared) {
+        return hint & SIMPLE_LONG_LIVED ? heap_malloc_long(size) : heap_malloc_short(size);
+    }
+
+    lock_heap();
+    ptr = hint & SIMPLE_LONG_LIVED ? heap_malloc_long(size) : heap_malloc_short(size);
+    unlock_heap();
+    return ptr;
+}
+
+
+/**
+ * @name    heap_free
+ * @brief   Frees a block of an initialized heap (locked if shared).
+ *
+ * @param void *ptr Pointer to the memory to free, not NULL.
+ *
+ */
+
+static void heap_free(void* ptr) {
+    // Only the start of a block in use has its bit in the block map, so the header is never
+    // read for a pointer that is foreign, interior or already free
+    if (!IN_USE_AT(ptr)) {
+        MM_TRACE("Invalid pointer passed to free: %p\n", ptr);
+        return;
+    }
+
+    BlockHeader *block = DATA_BLOCK(ptr);
+    int was_top = block == top;
+
+    super->clean = 0;
+    map_clear(ptr);
     SET_FREE(block, 1); // Mark the block as free
+    size_t holes_merged = 0;
 
     // Attempt to merge with the next block if it's free and not the dummy block
     BlockHeader *next_block = GET_NEXT(block);
     while (GET_FREE(next_block) && next_block != first) {
+        if (next_block == current) current = block; // Never leave the search pointers inside a merged block
+        if (next_block == long_current) long_current = block;
+        if (next_block != wilderness) holes_merged++;
         SET_NEXT(block, GET_NEXT(next_block)); // Link to the block after next
         next_block = GET_NEXT(block); // Update next_block to the new next block
-        printf("Freeing block at %p and merging with next block\n", (void*)block);
+        MM_TRACE("Freeing block at %p and merging with next block\n", (void*)block);
+    }
+
+    // Merge into the previous block if it is free
+    if (GET_PREV_FREE(block)) {
+        BlockHeader *prev_block = PREV_BLOCK(block);
+        if (block == current) current = prev_block;
+        if (block == long_current) long_current = prev_block;
+        if (prev_block != wilderness) holes_merged++;
+        SET_NEXT(prev_block, GET_NEXT(block));
+        block = prev_block;
+        MM_TRACE("Freeing block at %p and merging with previous block\n", (void*)block);
+    }
+
+    SET_FOOTER(block);
+    SET_PREV_FREE((BlockHeader *)GET_NEXT(block), 1);
+
+    // A free block in front of the long-lived region grows the wilderness, anything else is a hole
+    if (was_top) top = GET_NEXT(block); // The region now starts at the next block in use
+    if (GET_NEXT(block) == top) {
+        wilderness = block;
+        hole_count -= holes_merged;
+    } else {
+        hole_count = hole_count + 1 - holes_merged;
+        if (block < top && SIZE(block) > hole_max) hole_max = SIZE(block);
+        if (block > top && SIZE(block) > long_hole_max) long_hole_max = SIZE(block);
+    }
+    if (hole_count == 0) hole_max = long_hole_max = 0;
+
+    MM_TRACE("Freeing block at %p\n", (void*)block);
+}
+
+
+/**
+ * @name    simple_free
+ * @brief   Frees previously allocated memory and makes it available for subsequent calls to simple_malloc
+ *
+ * This function should behave similar to a normal free implementation. In a shared
+ * heap the block may have been allocated by another process. Pointers that are not
+ * the start of a block in use (foreign, interior or already freed) are left alone.
+ *
+ * @param void *ptr Pointer to the memory to free.
+ *
+ */
+
+void simple_free(void* ptr) {
+    if (ptr == NULL) return;
+    if (GUARD_OWNS(ptr)) {
+        guard_free(ptr, __builtin_return_address(0));
+        return;
+    }
+    if (!memory_shared) {
+        heap_free(ptr);
+        return;
     }
 
-    printf("Freeing block at %p\n", (void*)block);
+    lock_heap();
+    heap_free(ptr);
+    unlock_heap();
+}
+
+
+/**
+ * @name    simple_usable_size
+ * @brief   Returns the number of bytes usable by the caller in a block returned by simple_malloc.
+ *
+ * @param void *ptr Pointer previously returned by simple_malloc or simple_memalign.
+ * @retval Size of the user part of the block, or 0 for NULL and pointers that are not a block in use.
+ *
+ */
+
+size_t simple_usable_size(void* ptr) {
+    size_t size;
+
+    if (ptr == NULL) return 0;
+    if (GUARD_OWNS(ptr)) return guard_usable_size(ptr);
+    if (!memory_shared) return IN_USE_AT(ptr) ? SIZE(DATA_BLOCK(ptr)) : 0;
+
+    // Another process may split or merge the block meanwhile
+    lock_heap();
+    size = IN_USE_AT(ptr) ? SIZE(DATA_BLOCK(ptr)) : 0;
+    unlock_heap();
+    return size;
+}
+
+
+/**
+ * @name    heap_block_start
+ * @brief   simple_block_start for the arena of an initialized heap (locked if shared).
+ */
+
+static void* heap_block_start(const void* ptr) {
+    long i;
+    uintptr_t start;
+
+    if ((uintptr_t)ptr - map_base >= map_words * 64 * ALIGNMENT) return NULL;
+    i = map_find_before(MAP_INDEX(ptr));
+    if (i < 0) return NULL;
+
+    // The nearest block in use below ptr holds it unless ptr lies in a free block behind it
+    start = map_base + (uintptr_t)i * ALIGNMENT;
+    return (uintptr_t)ptr < start + SIZE(DATA_BLOCK(start)) ? (void *)start : NULL;
+}
+
+
+/**
+ * @name    simple_block_start
+ * @brief   Finds the block in use that holds ptr, which may point anywhere inside it.
+ *
+ * Takes one look at the block map word of ptr, and at the summary for each
+ * 32 KB (64 KB with MM_OOB_META) of free memory below it.
+ *
+ * @param const void *ptr Any address.
+ * @retval Pointer to the start of the block holding ptr, or NULL if no block in use does.
+ *
+ */
+
+void* simple_block_start(const void* ptr) {
+    void *start;
+
+    if (GUARD_OWNS(ptr)) return guard_block_start(ptr);
+    if (first == NULL) return NULL;
+    if (!memory_shared) return heap_block_start(ptr);
+
+    lock_heap();
+    start = heap_block_start(ptr);
+    unlock_heap();
+    return start;
+}
+
+
+/**
+ * @name    heap_memalign
+ * @brief   simple_memalign for alignments above ALIGNMENT on an initialized heap (locked if shared).
+ */
+
+static void* heap_memalign(size_t alignment, size_t size) {
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST) return NULL; // The padded size would wrap around
+    size_t aligned_size = ALIGN_SIZE(size);
+    void *raw = heap_malloc(aligned_size + alignment + BLOCK_OVERHEAD + MIN_SIZE);
+    if (raw == NULL) return NULL;
+    if (((uintptr_t)raw & (alignment - 1)) == 0) return raw;
+
+    // Leave room for a leading free block in front of the aligned block
+    uintptr_t aligned = ((uintptr_t)raw + BLOCK_OVERHEAD + MIN_SIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    BlockHeader *block = DATA_BLOCK(raw);
+    BlockHeader *aligned_block = DATA_BLOCK(aligned);
+
+    super->clean = 0;
+    aligned_block->next = 0;
+    SET_NEXT(aligned_block, GET_NEXT(block));
+    SET_FREE(aligned_block, 0);
+    SET_NEXT(block, aligned_block);
+    map_set((void *)aligned);
+    heap_free(raw); // Release the leading part
+
+    return (void *)aligned;
+}
+
+
+/**
+ * @name    simple_memalign
+ * @brief   Allocate at least size bytes whose first byte is aligned to alignment.
+ *
+ * Over-allocates a block and, if the user pointer is not already aligned, carves a
+ * free block off the front so that the returned block can still be released with
+ * simple_free. alignment must be a power of two.
+ *
+ * @param size_t alignment Required alignment in bytes.
+ * @param size_t size Number of bytes to allocate.
+ * @retval Pointer to the start of the allocated memory or NULL if not possible.
+ *
+ */
+
+void* simple_memalign(size_t alignment, size_t size) {
+    void *ptr;
+
+    if (alignment & (alignment - 1)) return NULL; // Not a power of two
+    if (alignment <= ALIGNMENT) return simple_malloc(size); // simple_malloc already guarantees this
+
+    if (first == NULL) {
+        simple_init();
+        if (first == NULL) return NULL;
+    }
+    if (!memory_shared) return heap_memalign(alignment, size);
+
+    lock_heap();
+    ptr = heap_memalign(alignment, size);
+    unlock_heap();
+    return ptr;
+}
+
+
+/**
+ * @name    simple_set_root
+ * @brief   Remember ptr as the root of the heap, to be found again with simple_get_root.
+ *
+ * In a heap file the root is stored as an offset, so it survives the process and
+ * is valid wherever the file is mapped next time.
+ *
+ * @param void *ptr Block returned by simple_malloc, or NULL.
+ *
+ */
+
+void simple_set_root(void* ptr) {
+    if (first == NULL) simple_init();
+    super->root = TO_OFFSET(ptr);
+}
+
+
+/**
+ * @name    simple_get_root
+ * @brief   Returns the root set with simple_set_root, here or by an earlier user of the heap file.
+ *
+ * @retval Root block, or NULL if none was set.
+ *
+ */
+
+void* simple_get_root(void) {
+    if (first == NULL) simple_init();
+    return FROM_OFFSET(super->root);
+}
+
+
+/**
+ * @name    simple_heap_sync
+ * @brief   Save the allocator state in the heap file and write it back to disk.
+ *
+ * Called at exit for heap files. A heap file that is opened again after a sync and
+ * no later change is used without looking at its blocks. Does nothing otherwise.
+ *
+ */
+
+void simple_heap_sync(void) {
+    if (!memory_persistent || first == NULL) return;
+
+    if (!memory_shared) save_state(); // A shared heap saves it on every unlock
+    msync((void *)memory_start, memory_end - memory_start, MS_SYNC);
 }
 
 
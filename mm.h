@@ -6,9 +6,15 @@
  *
  */
 
+#ifndef MM_H_
+#define MM_H_
+
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
 /**
@@ -22,22 +28,111 @@ void * simple_malloc(size_t size);
 /**
  * @name    simple_free
  * @brief   Frees previously allocated memory and make it available for subsequent calls to simple_malloc.
+ *          Pointers that are not the start of a block in use are ignored.
  */
 void simple_free(void * ptr);
 
 
+/* Lifetime hints for simple_malloc_hint */
+#define SIMPLE_SHORT_LIVED 0x1
+#define SIMPLE_LONG_LIVED  0x2
+
+/**
+ * @name    simple_malloc_hint
+ * @brief   Allocate like simple_malloc, placing SIMPLE_LONG_LIVED blocks together at the end of
+ *          the heap and SIMPLE_SHORT_LIVED ones at the start, so that holes can merge again.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_malloc_hint(size_t size, int hint);
+
+
+/**
+ * @name    simple_usable_size
+ * @brief   Returns the number of bytes the caller may use in a block returned by simple_malloc.
+ * @retval  Usable size of the block, or 0 for NULL and pointers that are not a block in use.
+ */
+size_t simple_usable_size(void * ptr);
+
+
+/**
+ * @name    simple_block_start
+ * @brief   Finds the block in use that holds ptr, which may point anywhere inside it.
+ * @retval  Start of the block, or NULL if ptr is not inside a block in use.
+ */
+void * simple_block_start(const void * ptr);
+
+
+/**
+ * @name    simple_memalign
+ * @brief   Allocate at least size bytes aligned to alignment (a power of two). Free with simple_free.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_memalign(size_t alignment, size_t size);
+
+
 /**
  * @name    The lowest address of the memory you will manage
  * @brief   This points to the lowest address of memory you will manage
  */
-extern const uintptr_t memory_start;
+extern uintptr_t memory_start;
 
 
 /**
  * @name    The limit of the memory you will manage
  * @brief   This points to the first address of memory you will NOT manage
  */
-extern const uintptr_t memory_end;
+extern uintptr_t memory_end;
+
+
+/**
+ * @name    Heap file flag
+ * @brief   Nonzero if the arena is a shared mapping of a heap file (SIMPLE_ARENA=file)
+ */
+extern int memory_persistent;
+
+
+/**
+ * @name    Shared heap flag
+ * @brief   Nonzero if the arena is shared memory used by several processes (SIMPLE_ARENA=shm).
+ *          Calls are then serialised by a lock in the arena, and a block may be freed by any of
+ *          the processes. Mappings differ between processes, so pass blocks on as offsets from
+ *          memory_start.
+ */
+extern int memory_shared;
+
+
+/**
+ * @name    simple_set_root
+ * @brief   Records ptr (a block from simple_malloc, or NULL) as the root of the heap.
+ *          In a heap file it is kept across processes and mapping addresses.
+ */
+void simple_set_root(void * ptr);
+
+
+/**
+ * @name    simple_get_root
+ * @brief   Returns the root of the heap, possibly set by an earlier process using the heap file.
+ * @retval  Root block or NULL.
+ */
+void * simple_get_root(void);
+
+
+/**
+ * @name    simple_heap_sync
+ * @brief   Saves the allocator state in the heap file and writes the file back. Runs at exit
+ *          for heap files, so that the next process can use the heap without walking it.
+ *          A shared heap saves its state on every call, so only the write back remains.
+ */
+void simple_heap_sync(void);
+
+
+/**
+ * @name    memory_setup
+ * @brief   Selects the backing of the arena (static, transparent or explicit huge pages, or a heap file) and
+ *          optionally prefaults it, as configured by SIMPLE_ARENA and SIMPLE_PREFAULT.
+ *          Updates memory_start and memory_end. Only the first call has any effect.
+ */
+void memory_setup(void);
 
 /**
  * @name    simple_macro_test
@@ -46,10 +141,72 @@ extern const uintptr_t memory_end;
  */
 int simple_macro_test(void);
 
+/**
+ * @name    simple_heap_check
+ * @brief   Makes an internal test of the free block bookkeeping against the block list
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_heap_check(void);
+
 /**
  * @name    simple_block_dump
  * @brief   Dumps the current list of blocks on standard out
  */
 void simple_block_dump(void);
 
+/**
+ * @name    simple_free_stats
+ * @brief   Stores the total size of the free blocks, the size of the largest one and their number
+ */
+void simple_free_stats(size_t * free_bytes, size_t * largest, size_t * blocks);
+
+
+/* Flags passed to a simple_walker and kept in a heap map */
+#define SIMPLE_BLOCK_FREE        0x1   // Free block
+#define SIMPLE_BLOCK_LONG_LIVED  0x2   // In the long-lived region at the end of the heap
+#define SIMPLE_BLOCK_WILDERNESS  0x4   // The free block the heap grows into
+#define SIMPLE_BLOCK_GUARDED     0x8   // Sampled block in a guard slot, outside the arena (walks only)
+
+/* Called for every block with its user pointer, usable size and flags. A nonzero
+ * return stops the walk. Must not allocate or free */
+typedef int (*simple_walker)(void * ctx, void * ptr, size_t size, int flags);
+
+/**
+ * @name    simple_heap_walk
+ * @brief   Calls walker for each block of the heap in address order, then for the blocks in guard slots.
+ * @retval  0 if every block was visited, otherwise the nonzero value returned by walker.
+ */
+int simple_heap_walk(simple_walker walker, void * ctx);
+
+
+/* Binary heap map: a SimpleHeapMapHeader followed by one SimpleHeapMapBlock per
+ * block of the arena in address order, in native byte order. Rendered by heap_map */
+#define SIMPLE_HEAP_MAP_MAGIC 0x3170614d70616548ULL   // "HeapMap1"
+
+typedef struct simple_heap_map_header {
+  uint64_t magic;       // SIMPLE_HEAP_MAP_MAGIC
+  uint64_t arena_size;  // memory_end - memory_start
+  uint64_t blocks;      // Number of SimpleHeapMapBlock records that follow
+  uint32_t alignment;   // Alignment of user blocks
+  uint32_t overhead;    // Header bytes in front of each block (0 with MM_OOB_META)
+} SimpleHeapMapHeader;
+
+typedef struct simple_heap_map_block {
+  uint32_t offset;      // Of the user memory from memory_start
+  uint32_t size;        // Usable bytes
+  uint32_t flags;       // SIMPLE_BLOCK_*
+} SimpleHeapMapBlock;
+
+/**
+ * @name    simple_heap_map_write
+ * @brief   Writes a heap map of the arena to fd with a single write. With SIMPLE_HEAP_MAP=path in
+ *          the environment one is also written to path at exit.
+ * @retval  0 if ok, otherwise -1 with errno set (EFBIG for arenas of 4 GB or more).
+ */
+int simple_heap_map_write(int fd);
+
+#ifdef __cplusplus
+}
+#endif
 
+#endif /* MM_H_ */
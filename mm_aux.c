@@ -7,50 +7,113 @@
  * @brief   Makes an internal test of the given macros
  * @retval  0 if ok, otherwise a positive number indicating the error cause
  */
+#ifndef MM_OOB_META
 int simple_macro_test() {
-  BlockHeader block;
-  BlockHeader * p = &block;
-  void * addr[2] = { (void *)  0x1234BABA, (void *) 0xFEDCBA981234BABA };
+  uint64_t buffer[0x80];
+  uintptr_t saved_base = heap_base;
+  BlockHeader * p;
+  BlockHeader * q;
+  uint32_t offsets[2] = { 0x1234BAB8, 0xFEDCBA98 };
   int i;
   int ret = 0;
 
-  /* Test separately for 32 and 64 bit addresses */
+  /* Headers hold offsets from heap_base; point it at a scratch buffer and restore it afterwards */
+  heap_base = (uintptr_t) buffer;
+  p = (BlockHeader *) (heap_base + 0x200);
+
+  /* Test separately for small and large (close to 4 GB) offsets */
   for (i =0; i < 2; i++) {
-    p->next = NULL;
+    void * addr = (void *) (heap_base + offsets[i]);
+
+    p->next = 0;
     /* Check that next and free are properly separated */
-    SET_NEXT(p, addr[i]);
+    SET_NEXT(p, addr);
     SET_FREE(p, 7);  /* only least bit should be used */
 
-    if (GET_NEXT(p) != addr[i]) return 1 + i*10;  // Next pointer damaged
-    if (GET_FREE(p) != 1)       return 2 + i*10;  // Free flag not set
+    if (GET_NEXT(p) != addr)    { ret = 1 + i*10; break; }  // Next offset damaged
+    if (GET_FREE(p) != 1)       { ret = 2 + i*10; break; }  // Free flag not set
+    if (GET_PREV_FREE(p) != 0)  { ret = 8 + i*10; break; }  // Free flag leaked into prev-free
 
-    SET_NEXT(p, NULL);
-    if (GET_FREE(p) != 1)       return 3 + i*10;  // Free flag damaged
+    SET_NEXT(p, heap_base);
+    if (GET_FREE(p) != 1)       { ret = 3 + i*10; break; }  // Free flag damaged
 
-    SET_NEXT(p, addr[i]);
+    SET_NEXT(p, addr);
     SET_FREE(p, 0);
+    SET_PREV_FREE(p, 1);
 
-    if (GET_FREE(p) != 0)       return 4 + i*10;  // Free flag not cleared
-    if (GET_NEXT(p) != addr[i]) return 5 + i*10;  // Next pointer damaged
+    if (GET_FREE(p) != 0)       { ret = 4 + i*10; break; }  // Free flag not cleared
+    if (GET_NEXT(p) != addr)    { ret = 5 + i*10; break; }  // Next offset damaged
+    if (GET_PREV_FREE(p) != 1)  { ret = 9 + i*10; break; }  // Prev-free flag not set
 
     /* Check size with and without flag */
     SET_FREE(p,i);
 
     /* Check size for forward next pointer */
-    SET_NEXT(p, (void *) ((uintptr_t) p + sizeof(BlockHeader) + 0x100 ) );
-    if (SIZE(p) !=  0x100)      return 6 + i*10;
+    SET_NEXT(p, (void *) ((uintptr_t) p + sizeof(BlockHeader) + 0x104 ) );
+    if (SIZE(p) !=  0x104)      { ret = 6 + i*10; break; }
 
     /* Check size for backward next pointer (dummy block) */
-    SET_NEXT(p, (void *) ((uintptr_t) p + sizeof(BlockHeader) - 0x100 ) );
-    if (SIZE(p) != 0 && SIZE(p) < 0x800000000000000 )   return 7 + i*10;
-  
+    SET_NEXT(p, (void *) ((uintptr_t) p - 0x100 ) );
+    if (SIZE(p) != 0 && SIZE(p) < 0x800000000000000 )   { ret = 7 + i*10; break; }
+
+    /* Check that a footer leads back from the following block */
+    q = (BlockHeader *) ((uintptr_t) p + sizeof(BlockHeader) + 0x14);
+    SET_NEXT(p, q);
+    SET_FOOTER(p);
+    if (PREV_BLOCK(q) != p)     { ret = 10 + i*10; break; }
   }
+
+  heap_base = saved_base;
   return ret;
 } 
+#else
+int simple_macro_test() {
+  BlockHeader * p;
+  BlockHeader saved;
+  size_t offsets[2] = { 0x100, 0x12345 };
+  int i;
+  int ret = 0;
+
+  /* Headers only make sense inside the header array, so borrow one and restore it */
+  simple_init();
+  p = meta + 1;
+  saved = *p;
+
+  for (i = 0; i < 2; i++) {
+    BlockHeader * target = p + offsets[i];
+
+    p->next = 0;
+    /* Check that next and free are properly separated */
+    SET_NEXT(p, target);
+    SET_FREE(p, 7);  /* only least bit should be used */
+
+    if (GET_NEXT(p) != target) { ret = 1 + i*10; break; }  // Next index damaged
+    if (GET_FREE(p) != 1)      { ret = 2 + i*10; break; }  // Free flag not set
+
+    SET_NEXT(p, meta);
+    if (GET_FREE(p) != 1)      { ret = 3 + i*10; break; }  // Free flag damaged
+
+    SET_NEXT(p, target);
+    SET_FREE(p, 0);
+
+    if (GET_FREE(p) != 0)      { ret = 4 + i*10; break; }  // Free flag not cleared
+    if (GET_NEXT(p) != target) { ret = 5 + i*10; break; }  // Next index damaged
+
+    /* Check size and the mapping between headers and user memory */
+    SET_FREE(p, i);
+    if (SIZE(p) != offsets[i] * CHUNK_SIZE)             { ret = 6 + i*10; break; }
+    if (DATA_BLOCK(BLOCK_DATA(target)) != target)        { ret = 7 + i*10; break; }
+    if (BLOCK_AFTER(p, SIZE(p)) != target)               { ret = 8 + i*10; break; }
+  }
+
+  *p = saved;
+  return ret;
+}
+#endif
 
 
 static void print_block(BlockHeader * p) {
-  printf("Block at 0x%08lx next = 0x%08lx, free = %d\n",  (uintptr_t) p, (uintptr_t) GET_NEXT(p), GET_FREE(p));
+  write_fmt("Block at 0x%08lx next = 0x%08lx, free = %d\n",  (uintptr_t) p, (uintptr_t) GET_NEXT(p), GET_FREE(p));
 }
 
 
@@ -62,17 +125,17 @@ void simple_block_dump(void) {
   BlockHeader * p;
 
   if (first == NULL) {
-    printf("Data structure is not initialized\n");
+    write_fmt("Data structure is not initialized\n");
     return;
   }
 
-  printf("first = 0x%08lx, current = 0x%08lx\n", (uintptr_t) first, (uintptr_t) current);
+  write_fmt("first = 0x%08lx, current = 0x%08lx\n", (uintptr_t) first, (uintptr_t) current);
 
   p = first;
 
   do {
-    if ((uintptr_t) p < memory_start || (uintptr_t) p >= memory_end) {
-      printf("Block pointer 0x%08lx out of range\n", (uintptr_t) p);
+    if (!VALID_BLOCK(p)) {
+      write_fmt("Block pointer 0x%08lx out of range\n", (uintptr_t) p);
       return;
     }
 
@@ -83,3 +146,190 @@ void simple_block_dump(void) {
 
 }
 
+
+static void free_stats(size_t * free_bytes, size_t * largest, size_t * blocks) {
+  BlockHeader * p;
+
+  for (p = first; p != last; p = GET_NEXT(p)) {
+    if (!GET_FREE(p)) continue;
+    *free_bytes += SIZE(p);
+    if (SIZE(p) > *largest) *largest = SIZE(p);
+    (*blocks)++;
+  }
+}
+
+
+/**
+ * @name    simple_free_stats
+ * @brief   Sums up the free blocks: their total size, the largest one and their number.
+ *          A shared heap stays locked while they are counted.
+ */
+void simple_free_stats(size_t * free_bytes, size_t * largest, size_t * blocks) {
+  *free_bytes = *largest = *blocks = 0;
+  if (first == NULL) return;
+  if (!memory_shared) {
+    free_stats(free_bytes, largest, blocks);
+    return;
+  }
+
+  lock_heap();
+  free_stats(free_bytes, largest, blocks);
+  unlock_heap();
+}
+
+
+/**
+ * @name    simple_heap_check
+ * @brief   Counts the holes and finds the largest of each region, which hole_count, hole_max
+ *          and long_hole_max must match or bound, and checks that the wilderness is in front of top.
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_heap_check(void) {
+  BlockHeader * p;
+  size_t holes = 0, largest = 0, long_largest = 0;
+  int missed = 0;                       // A free block in front of top that is not the wilderness
+  int ret = 0;
+
+  if (first == NULL) return 0;
+  if (memory_shared) lock_heap();
+  for (p = first; p != last; p = GET_NEXT(p)) {
+    if (!GET_FREE(p) || p == wilderness) continue;
+    if (GET_NEXT(p) == top) missed = 1;
+    holes++;
+    if (p < top && SIZE(p) > largest) largest = SIZE(p);
+    if (p >= top && SIZE(p) > long_largest) long_largest = SIZE(p);
+  }
+  if (holes != hole_count)                                                  ret = 1;
+  else if (largest > hole_max)                                              ret = 2;
+  else if (long_largest > long_hole_max)                                    ret = 3;
+  else if (wilderness != NULL && (!GET_FREE(wilderness) || GET_NEXT(wilderness) != top)) ret = 4;
+  else if (missed)                                                          ret = 5;
+  if (memory_shared) unlock_heap();
+  return ret;
+}
+
+
+/* Flags of block p for walks and heap maps */
+static int block_flags(BlockHeader * p) {
+  int flags = GET_FREE(p) ? SIMPLE_BLOCK_FREE : 0;
+
+  if (p >= top) flags |= SIMPLE_BLOCK_LONG_LIVED;
+  if (p == wilderness) flags |= SIMPLE_BLOCK_WILDERNESS;
+  return flags;
+}
+
+static int walk_blocks(simple_walker walker, void * ctx) {
+  BlockHeader * p;
+  size_t i;
+  int ret;
+
+  for (p = first; p != last; p = GET_NEXT(p)) {
+    if ((ret = walker(ctx, BLOCK_DATA(p), SIZE(p), block_flags(p))) != 0) return ret;
+  }
+  for (i = 0; i < guard_slot_count; i++) {
+    if (guard_slots[i].state != GUARD_LIVE) continue;
+    if ((ret = walker(ctx, (void *) guard_slots[i].ptr, guard_usable_size((void *) guard_slots[i].ptr), SIMPLE_BLOCK_GUARDED)) != 0) return ret;
+  }
+  return 0;
+}
+
+
+/**
+ * @name    simple_heap_walk
+ * @brief   Calls walker for every block: those of the arena in address order, then the sampled
+ *          blocks in guard slots. A shared heap stays locked during the walk.
+ * @retval  0 if every block was visited, otherwise the value returned by walker.
+ */
+int simple_heap_walk(simple_walker walker, void * ctx) {
+  int ret;
+
+  if (first == NULL) simple_init();
+  if (first == NULL) return 0;
+  if (!memory_shared) return walk_blocks(walker, ctx);
+
+  lock_heap();
+  ret = walk_blocks(walker, ctx);
+  unlock_heap();
+  return ret;
+}
+
+
+/* Writes the map of the arena to fd: the blocks are counted, copied into a
+ * private mapping behind the header and written out in one go */
+static int write_heap_map(int fd) {
+  SimpleHeapMapHeader * header;
+  SimpleHeapMapBlock * record;
+  BlockHeader * p;
+  size_t blocks = 0;
+  size_t len;
+  size_t done = 0;
+  int ret = 0;
+
+  if (memory_end - memory_start > UINT32_MAX) {
+    errno = EFBIG;  // Records hold 32 bit offsets
+    return -1;
+  }
+  for (p = first; p != last; p = GET_NEXT(p)) blocks++;
+
+  len = sizeof(SimpleHeapMapHeader) + blocks * sizeof(SimpleHeapMapBlock);
+  header = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (header == MAP_FAILED) return -1;
+
+  header->magic = SIMPLE_HEAP_MAP_MAGIC;
+  header->arena_size = memory_end - memory_start;
+  header->blocks = blocks;
+  header->alignment = ALIGNMENT;
+  header->overhead = BLOCK_OVERHEAD;
+  record = (SimpleHeapMapBlock *) (header + 1);
+  for (p = first; p != last; p = GET_NEXT(p), record++) {
+    record->offset = (uint32_t) ((uintptr_t) BLOCK_DATA(p) - memory_start);
+    record->size = (uint32_t) SIZE(p);
+    record->flags = block_flags(p);
+  }
+
+  while (done < len) {
+    ssize_t n = write(fd, (char *) header + done, len - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      ret = -1;
+      break;
+    }
+    done += n;
+  }
+  munmap(header, len);
+  return ret;
+}
+
+
+/**
+ * @name    simple_heap_map_write
+ * @brief   Writes a heap map (see mm.h) of the arena to fd, for heap_map to render.
+ *          Sampled blocks in guard slots are not part of the arena and left out.
+ * @retval  0 if ok, otherwise -1 with errno set.
+ */
+int simple_heap_map_write(int fd) {
+  int ret;
+
+  if (first == NULL) simple_init();
+  if (first == NULL) return -1;
+  if (!memory_shared) return write_heap_map(fd);
+
+  lock_heap();
+  ret = write_heap_map(fd);
+  unlock_heap();
+  return ret;
+}
+
+
+/* Writes the heap map asked for by SIMPLE_HEAP_MAP at exit */
+static void heap_map_at_exit(void) {
+  const char * path = getenv("SIMPLE_HEAP_MAP");
+  int fd;
+
+  if (path == NULL || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) return;
+  if (simple_heap_map_write(fd) != 0) {
+    static const char msg[] = "Cannot write the heap map\n";
+    (void)!write(2, msg, sizeof(msg) - 1);
+  }
+  close(fd);
+}
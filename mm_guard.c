@@ -0,0 +1,313 @@
+/* Sampled guard pages, included by mm.c */
+
+/*
+ * With SIMPLE_GUARD_SAMPLE=N in the environment, about one in N calls of
+ * simple_malloc (and simple_malloc_hint) is served from a pool of guard slots
+ * outside the arena instead of the heap. Each slot is a page of its own between
+ * two inaccessible guard pages:
+ *
+ *   guard | slot 0 | guard | slot 1 | guard | ... | slot n-1 | guard
+ *
+ * Blocks are put at the end of their page, so that running off the end hits the
+ * guard page after it, or every other time at the start, to catch underflows.
+ * simple_free makes the page inaccessible again, so a later use of the block
+ * faults as well, until the slot is reused. A fault in the pool is reported on
+ * stderr by a SIGSEGV handler, with the block and the return addresses of the
+ * simple_malloc and simple_free calls (for addr2line), before the process dies
+ * of the signal as usual. A double or invalid free of a sampled block is
+ * reported by simple_free, which then aborts.
+ *
+ *   SIMPLE_GUARD_SAMPLE = 0 (default, off) | N
+ *   SIMPLE_GUARD_SLOTS  = number of slots (default 16)
+ *
+ * Blocks larger than a page, and blocks requested while all slots are in use,
+ * are not sampled. Slots are reused round robin, so the oldest freed block is
+ * the first to lose its protection. With sampling off the cost is one
+ * test in simple_malloc and one in simple_free; with it on, one count down per
+ * allocation plus an mprotect on each sampled allocation and free.
+ *
+ * The pool is private to the process, so heap files and shared heaps
+ * (SIMPLE_ARENA=file or shm) are never sampled. A SIGSEGV handler installed
+ * later by the program replaces the report.
+ */
+
+#include <signal.h>
+
+#define GUARD_DEFAULT_SLOTS 16
+
+enum guard_state { GUARD_UNUSED, GUARD_LIVE, GUARD_FREED };
+
+typedef struct guard_slot {
+    uintptr_t ptr;            // User pointer of the block in the slot's page
+    size_t size;              // Requested size
+    void *alloc_site;         // Return address of the allocating call
+    void *free_site;          // Return address of the freeing call
+    uint8_t state;            // enum guard_state
+    uint8_t at_start;         // Block starts at the page instead of ending with it
+} GuardSlot;
+
+static uintptr_t guard_start = 0;     // First guard page of the pool
+static uintptr_t guard_span = 0;      // Bytes in the pool, 0 if sampling is off
+static size_t guard_page = 0;
+static GuardSlot * guard_slots = NULL;
+static size_t guard_slot_count = 0;
+static size_t guard_next_slot = 0;    // Round robin position of the slot search
+static size_t guard_rate = 0;
+static size_t guard_countdown = 0;    // Allocations until the next sample, 0 if sampling is off
+static uint64_t guard_random = 0;
+static struct sigaction guard_old_action;
+
+#define GUARD_OWNS(ptr)  ((uintptr_t)(ptr) - guard_start < guard_span)
+#define GUARD_ROUNDED(n) ((n) == 0 ? ALIGNMENT : ((n) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+/* Allocations until the next sample: uniform in 1 .. 2 * guard_rate - 1, so one in guard_rate on average */
+static size_t guard_interval(void) {
+    guard_random ^= guard_random << 13;
+    guard_random ^= guard_random >> 7;
+    guard_random ^= guard_random << 17;
+    return 1 + guard_random % (2 * guard_rate - 1);
+}
+
+/* Report text is put together on the stack, as the report may come from a signal handler */
+typedef struct guard_report {
+    char text[512];
+    size_t len;
+} GuardReport;
+
+static void report_string(GuardReport *r, const char *s) {
+    while (*s != '\0' && r->len < sizeof(r->text)) r->text[r->len++] = *s++;
+}
+
+static void report_decimal(GuardReport *r, size_t n) {
+    char digits[20];
+    size_t k = format_long(digits, (long)n);
+    size_t i;
+
+    for (i = 0; i < k && r->len < sizeof(r->text); i++) r->text[r->len++] = digits[i];
+}
+
+static void report_pointer(GuardReport *r, const void *p) {
+    static const char hex[] = "0123456789abcdef";
+    uintptr_t v = (uintptr_t)p;
+    int shift;
+
+    report_string(r, "0x");
+    for (shift = sizeof(uintptr_t) * 8 - 4; shift > 0 && (v >> shift) == 0; shift -= 4) {}
+    for (; shift >= 0 && r->len < sizeof(r->text); shift -= 4) r->text[r->len++] = hex[(v >> shift) & 0xf];
+}
+
+/* Describe slot's block and where it was allocated and freed, and write the report */
+static void report_block(GuardReport *r, const GuardSlot *slot) {
+    report_string(r, "  block of ");
+    report_decimal(r, slot->size);
+    report_string(r, " bytes at ");
+    report_pointer(r, (void *)slot->ptr);
+    report_string(r, slot->state == GUARD_FREED ? " (freed)" : " (in use)");
+    report_string(r, "\n  allocated by ");
+    report_pointer(r, slot->alloc_site);
+    if (slot->state == GUARD_FREED) {
+        report_string(r, "\n  freed by ");
+        report_pointer(r, slot->free_site);
+    }
+    report_string(r, "\n");
+    (void)!write(2, r->text, r->len);
+}
+
+/* The slot whose block an access at addr in the pool belongs to, or NULL */
+static GuardSlot * guard_slot_of(uintptr_t addr, const char **what) {
+    size_t page = (addr - guard_start) / guard_page;
+    GuardSlot *before = page >= 2 ? &guard_slots[page / 2 - 1] : NULL;  // Slot in the page in front of a guard page
+    GuardSlot *after = page / 2 < guard_slot_count ? &guard_slots[page / 2] : NULL;
+
+    if (page % 2 == 1) {
+        *what = after->state == GUARD_FREED ? "use after free" : "access to an unused slot";
+        return after->state == GUARD_FREED ? after : NULL;
+    }
+    // A guard page: blame the block that ends at it or else the one that starts behind it
+    if (before != NULL && before->state != GUARD_UNUSED && !before->at_start) {
+        *what = "buffer overflow";
+        return before;
+    }
+    if (after != NULL && after->state != GUARD_UNUSED && after->at_start) {
+        *what = "buffer underflow";
+        return after;
+    }
+    *what = "access to a guard page";
+    return NULL;
+}
+
+static void guard_fault(int sig, siginfo_t *info, void *context) {
+    uintptr_t addr = (uintptr_t)info->si_addr;
+
+    if (GUARD_OWNS(addr)) {
+        GuardReport r = { .len = 0 };
+        const char *what;
+        GuardSlot *slot = guard_slot_of(addr, &what);
+
+        report_string(&r, "simple_malloc guard: ");
+        report_string(&r, what);
+        report_string(&r, " at ");
+        report_pointer(&r, (void *)addr);
+        if (slot != NULL && addr >= slot->ptr + slot->size) {
+            report_string(&r, ", ");
+            report_decimal(&r, addr - slot->ptr - slot->size);
+            report_string(&r, " bytes after the end");
+        } else if (slot != NULL && addr < slot->ptr) {
+            report_string(&r, ", ");
+            report_decimal(&r, slot->ptr - addr);
+            report_string(&r, " bytes before the start");
+        } else if (slot != NULL) {
+            report_string(&r, ", ");
+            report_decimal(&r, addr - slot->ptr);
+            report_string(&r, " bytes into the block");
+        }
+        report_string(&r, "\n");
+        if (slot != NULL) {
+            report_block(&r, slot);
+        } else {
+            (void)!write(2, r.text, r.len);
+        }
+    }
+    // Hand the fault on: the access is retried and now meets the previous handler
+    sigaction(SIGSEGV, &guard_old_action, NULL);
+    if (info->si_code <= 0) raise(sig); // Sent by kill(), there is no access to retry
+}
+
+/**
+ * @name    guard_setup
+ * @brief   Map the guard pool and install the fault report if SIMPLE_GUARD_SAMPLE asks for sampling.
+ */
+static void guard_setup(void) {
+    const char *rate = getenv("SIMPLE_GUARD_SAMPLE");
+    const char *slots = getenv("SIMPLE_GUARD_SLOTS");
+    struct sigaction action;
+    size_t count;
+    void *pool;
+    void *meta_pages;
+
+    if (rate == NULL || (guard_rate = strtoul(rate, NULL, 10)) == 0) return;
+    count = slots != NULL ? strtoul(slots, NULL, 10) : GUARD_DEFAULT_SLOTS;
+    if (count == 0) return;
+
+    guard_page = sysconf(_SC_PAGESIZE);
+    pool = mmap(NULL, (2 * count + 1) * guard_page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    meta_pages = mmap(NULL, count * sizeof(GuardSlot), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED || meta_pages == MAP_FAILED) {
+        static const char msg[] = "simple_malloc guard: cannot map the guard pool, sampling is off\n";
+        (void)!write(2, msg, sizeof(msg) - 1);
+        if (pool != MAP_FAILED) munmap(pool, (2 * count + 1) * guard_page);
+        if (meta_pages != MAP_FAILED) munmap(meta_pages, count * sizeof(GuardSlot));
+        return;
+    }
+
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_old_action);
+
+    guard_slots = meta_pages;
+    guard_slot_count = count;
+    guard_start = (uintptr_t)pool;
+    guard_span = (2 * count + 1) * guard_page;
+    guard_random = (uint64_t)(uintptr_t)&action ^ ((uint64_t)getpid() << 32) ^ 0x9E3779B97F4A7C15ULL;
+    guard_countdown = guard_interval();
+}
+
+/**
+ * @name    guard_malloc
+ * @brief   Serve a sampled allocation from a guard slot.
+ *
+ * @param size_t size Number of bytes to allocate.
+ * @param void *site Return address of the simple_malloc call, for reports.
+ * @retval Pointer to the block, or NULL if it is too large or no slot is free.
+ *
+ */
+static void* guard_malloc(size_t size, void *site) {
+    size_t rounded;
+    size_t i;
+
+    guard_countdown = guard_interval();
+    if (size > guard_page) return NULL; // Also keeps the rounding from wrapping around
+    rounded = GUARD_ROUNDED(size);
+
+    for (i = 0; i < guard_slot_count; i++) {
+        size_t k = (guard_next_slot + i) % guard_slot_count;
+        GuardSlot *slot = &guard_slots[k];
+        uintptr_t page = guard_start + (2 * k + 1) * guard_page;
+
+        if (slot->state == GUARD_LIVE) continue;
+        if (mprotect((void *)page, guard_page, PROT_READ | PROT_WRITE) != 0) return NULL;
+
+        guard_next_slot = k + 1;
+        slot->at_start = slot->state != GUARD_UNUSED && !slot->at_start; // End first, then alternate
+        slot->ptr = slot->at_start ? page : page + guard_page - rounded;
+        slot->size = size;
+        slot->alloc_site = site;
+        slot->free_site = NULL;
+        slot->state = GUARD_LIVE;
+        MM_TRACE("Allocating %zu bytes at %p (guarded)\n", rounded, (void *)slot->ptr);
+        return (void *)slot->ptr;
+    }
+    return NULL;
+}
+
+/**
+ * @name    guard_free
+ * @brief   Free a block of the guard pool, reporting double and invalid frees.
+ *
+ * @param void *ptr Pointer into the guard pool.
+ * @param void *site Return address of the simple_free call, for reports.
+ *
+ */
+static void guard_free(void *ptr, void *site) {
+    size_t page = ((uintptr_t)ptr - guard_start) / guard_page;
+    GuardSlot *slot = page % 2 == 1 ? &guard_slots[page / 2] : NULL;
+    GuardReport r = { .len = 0 };
+
+    if (slot != NULL && slot->state == GUARD_LIVE && slot->ptr == (uintptr_t)ptr) {
+        mprotect((void *)(guard_start + page * guard_page), guard_page, PROT_NONE);
+        slot->state = GUARD_FREED;
+        slot->free_site = site;
+        MM_TRACE("Freeing block at %p (guarded)\n", ptr);
+        return;
+    }
+
+    report_string(&r, "simple_malloc guard: ");
+    report_string(&r, slot != NULL && slot->state == GUARD_FREED && slot->ptr == (uintptr_t)ptr
+                      ? "double free of " : "invalid free of ");
+    report_pointer(&r, ptr);
+    report_string(&r, " by ");
+    report_pointer(&r, site);
+    report_string(&r, "\n");
+    if (slot != NULL && slot->state != GUARD_UNUSED) {
+        report_block(&r, slot);
+    } else {
+        (void)!write(2, r.text, r.len);
+    }
+    abort();
+}
+
+/* The slot whose page holds ptr if its block is in use, or NULL (also for guard pages) */
+static GuardSlot * guard_live_slot(const void *ptr) {
+    size_t page = ((uintptr_t)ptr - guard_start) / guard_page;
+    GuardSlot *slot = page % 2 == 1 ? &guard_slots[page / 2] : NULL;
+
+    return slot != NULL && slot->state == GUARD_LIVE ? slot : NULL;
+}
+
+/* Usable size of a block of the guard pool, 0 unless ptr is the start of a block in use */
+static size_t guard_usable_size(void *ptr) {
+    GuardSlot *slot = guard_live_slot(ptr);
+
+    if (slot == NULL || slot->ptr != (uintptr_t)ptr) return 0;
+    return GUARD_ROUNDED(slot->size);
+}
+
+/* Start of the block in use in the guard slot holding ptr, or NULL */
+static void* guard_block_start(const void *ptr) {
+    GuardSlot *slot = guard_live_slot(ptr);
+
+    if (slot == NULL || (uintptr_t)ptr < slot->ptr || (uintptr_t)ptr >= slot->ptr + GUARD_ROUNDED(slot->size)) return NULL;
+    return (void *)slot->ptr;
+}
@@ -0,0 +1,328 @@
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* You are not allowed to use <stdio.h> */
+#include "io.h"
+#include "scan.h"
+#include "interp.h"
+#include "pipeline.h"
+
+/* Stages and what they own:
+ *
+ *   parse    reads stdin and cuts it into runs of identical commands (scan.h),
+ *            which it passes on in command batches
+ *   execute  runs the batches on the interpreter on the main thread. The output of
+ *            the commands is not formatted there: the interpreter reports every run
+ *            (see report_run), and the runs are passed on as records in output
+ *            chunks, between text records that capture the rest of its output, which
+ *            is the allocator's trace
+ *   emit     formats the runs with write_run(), keeping the printed form of the
+ *            collection, and writes them and the text to stdout
+ *
+ * Each ring slot is filled in place by the producer and handed back when the consumer
+ * advances past it, so no buffers are allocated */
+
+#define RING_SLOTS     8              // Power of two
+#define BATCH_COMMANDS 4096
+#define OUTPUT_CHUNK   (64 * 1024)
+#define SPIN_LIMIT     256            // Polls before a waiting stage sleeps
+
+/* Single producer, single consumer ring. The producer owns tail, the consumer head.
+ * A stage that has to wait sleeps on the other stage's counter with a futex and sets
+ * the matching flag so that the other stage wakes it */
+struct ring {
+  _Alignas(64) unsigned head;
+  unsigned head_waiter;               // Producer sleeps on head (ring full)
+  _Alignas(64) unsigned tail;
+  unsigned tail_waiter;               // Consumer sleeps on tail (ring empty)
+};
+
+struct command_batch {
+  size_t count;
+  int last;                           // End of input, or the last command is not a command
+  struct {
+    char c;
+    size_t run;
+  } commands[BATCH_COMMANDS];
+};
+
+/* Output chunks hold records: a header, followed by count bytes for RECORD_TEXT */
+enum { RECORD_TEXT, RECORD_RUN };
+
+struct record {
+  int type;
+  char c;                             // RECORD_RUN: arguments of write_run()
+  int value;
+  const int* slot;
+  size_t count;                       // Bytes of text, or commands
+};
+
+struct output_chunk {
+  size_t len;
+  int last;                           // Nothing follows
+  char data[OUTPUT_CHUNK];
+};
+
+static struct ring commands;
+static struct command_batch batches[RING_SLOTS];
+static struct ring output;
+static struct output_chunk chunks[RING_SLOTS];
+
+/* Execute stage: chunk being filled and the open record in it, which can still grow */
+static struct output_chunk* chunk = NULL;
+static struct record open_record;
+static size_t open_header;            // Offset of its header
+static int record_open = 0;
+
+/* Waits until *word differs from old */
+static void
+wait_change(unsigned* word, unsigned* waiter, unsigned old) {
+  int spins;
+
+  for (spins = 0; spins < SPIN_LIMIT; spins++) {
+    if (__atomic_load_n(word, __ATOMIC_ACQUIRE) != old) return;
+  }
+  __atomic_store_n(waiter, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == old) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, old, NULL, NULL, 0);
+  }
+  __atomic_store_n(waiter, 0, __ATOMIC_RELAXED);
+}
+
+/* Advances the counter owned by the calling stage and wakes the other stage if it sleeps on it */
+static void
+advance(unsigned* word, unsigned* waiter) {
+  __atomic_store_n(word, __atomic_load_n(word, __ATOMIC_RELAXED) + 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiter, __ATOMIC_SEQ_CST)) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+/* Producer: waits for a free slot and returns its index */
+static unsigned
+ring_wait_space(struct ring* r) {
+  unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  unsigned head;
+
+  while (tail - (head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)) == RING_SLOTS) {
+    wait_change(&r->head, &r->head_waiter, head);
+  }
+  return tail % RING_SLOTS;
+}
+
+static void
+ring_publish(struct ring* r) {
+  advance(&r->tail, &r->tail_waiter);
+}
+
+/* Consumer: waits for a filled slot and returns its index */
+static unsigned
+ring_wait_data(struct ring* r) {
+  unsigned head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  unsigned tail;
+
+  while ((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == head) {
+    wait_change(&r->tail, &r->tail_waiter, tail);
+  }
+  return head % RING_SLOTS;
+}
+
+static void
+ring_release(struct ring* r) {
+  advance(&r->head, &r->head_waiter);
+}
+
+/* Parse stage. A batch is passed on when it is full and at the end of every span read,
+ * so that interactive input is not held back */
+static void*
+parse_stage(void* arg) {
+  struct command_batch* batch = NULL;
+  const char* span;
+  const char* end;
+  size_t len;
+  size_t run;
+  int done = 0;
+
+  while (!done && (len = read_span(&span)) > 0) {
+    for (end = span + len; span < end && !done; span += run) {
+      run = command_run(span, end);
+      if (batch == NULL) {
+        batch = &batches[ring_wait_space(&commands)];
+        batch->count = 0;
+        batch->last = 0;
+      }
+      batch->commands[batch->count].c = *span;
+      batch->commands[batch->count].run = run;
+      batch->count++;
+      done = !interp_is_command(*span);
+      if (batch->count == BATCH_COMMANDS && !done) {
+        ring_publish(&commands);
+        batch = NULL;
+      }
+    }
+    if (batch != NULL && !done) {
+      ring_publish(&commands);
+      batch = NULL;
+    }
+  }
+
+  if (batch == NULL) {
+    batch = &batches[ring_wait_space(&commands)];
+    batch->count = 0;
+  }
+  batch->last = 1;
+  ring_publish(&commands);
+  return NULL;
+}
+
+/* Writes the header of the open record */
+static void
+close_record() {
+  if (record_open) {
+    memcpy(chunk->data + open_header, &open_record, sizeof(open_record));
+    record_open = 0;
+  }
+}
+
+static void
+publish_chunk(int last) {
+  close_record();
+  chunk->last = last;
+  ring_publish(&output);
+  chunk = NULL;
+}
+
+/* Makes sure there is a chunk with room for need bytes */
+static void
+reserve_output(size_t need) {
+  if (chunk != NULL && chunk->len + need <= OUTPUT_CHUNK) return;
+  if (chunk != NULL) publish_chunk(0);
+  chunk = &chunks[ring_wait_space(&output)];
+  chunk->len = 0;
+  chunk->last = 0;
+}
+
+/* Closes the open record and opens r, whose header is written when it is closed */
+static void
+open_record_for(const struct record* r, size_t need) {
+  close_record();
+  reserve_output(sizeof(*r) + need);
+  open_record = *r;
+  open_header = chunk->len;
+  record_open = 1;
+  chunk->len += sizeof(*r);
+}
+
+/* Output sink of the execute stage: appends to the open text record */
+static void
+capture_text(void* arg, const char* p, size_t n) {
+  static const struct record text = { RECORD_TEXT, 0, 0, NULL, 0 };
+
+  while (n > 0) {
+    size_t k;
+
+    if (!record_open || open_record.type != RECORD_TEXT || chunk->len == OUTPUT_CHUNK) {
+      open_record_for(&text, 1);
+    }
+    k = OUTPUT_CHUNK - chunk->len;
+    if (k > n) k = n;
+    memcpy(chunk->data + chunk->len, p, k);
+    chunk->len += k;
+    open_record.count += k;
+    p += k;
+    n -= k;
+  }
+}
+
+/* Reporter of the interpreter (report_run). A removal right after another one, or a
+ * value added right after the previous one in the next slot, extends its record */
+static void
+capture_run(void* arg, char c, int value, const int* slot, size_t count) {
+  struct record r = { RECORD_RUN, c, value, slot, count };
+
+  if (record_open && open_record.type == RECORD_RUN && open_record.c == c &&
+      (c == 'c' ||
+       (c == 'a' && (size_t)(value - open_record.value) == open_record.count &&
+        (slot == NULL ? open_record.slot == NULL : open_record.slot != NULL && open_record.slot + open_record.count == slot)))) {
+    open_record.count += count;
+    return;
+  }
+  open_record_for(&r, 0);
+}
+
+/* Emit stage: the only thread that writes to stdout */
+static void*
+emit_stage(void* arg) {
+  CollectionText text = COLLECTION_TEXT_INIT;
+  int last = 0;
+
+  while (!last) {
+    struct output_chunk* c = &chunks[ring_wait_data(&output)];
+    size_t pos = 0;
+
+    while (pos < c->len) {
+      struct record r;
+
+      memcpy(&r, c->data + pos, sizeof(r));
+      pos += sizeof(r);
+      if (r.type == RECORD_TEXT) {
+        write_bytes(c->data + pos, r.count);
+        pos += r.count;
+      } else {
+        write_run(&text, r.c, r.value, r.slot, r.count);
+      }
+    }
+    last = c->last;
+    ring_release(&output);
+  }
+  free_text(&text);
+  return NULL;
+}
+
+int run_pipelined(void) {
+  Interpreter interp = INTERPRETER_INIT;
+  pthread_t parser;
+  pthread_t emitter;
+  int running = 1;
+  int last = 0;
+
+  io_use_threads();
+  if (pthread_create(&parser, NULL, parse_stage, NULL) != 0) {
+    return 1;
+  }
+  if (pthread_create(&emitter, NULL, emit_stage, NULL) != 0) {
+    pthread_join(parser, NULL);
+    return 1;
+  }
+
+  // Execute stage
+  set_output_sink(capture_text, NULL);
+  interp_defer_output(&interp, capture_run, NULL);
+  while (running && !last) {
+    struct command_batch* batch = &batches[ring_wait_data(&commands)];
+    size_t i;
+
+    for (i = 0; i < batch->count && running; i++) {
+      running = interp_run(&interp, batch->commands[i].c, batch->commands[i].run);
+    }
+    last = batch->last;
+    ring_release(&commands);
+    if (chunk != NULL && running && !last) {
+      publish_chunk(0);   // Let the output of the batch go out while waiting for the next
+    }
+  }
+  interp_finish(&interp);
+  reserve_output(0);
+  publish_chunk(1);
+  set_output_sink(NULL, NULL);
+
+  pthread_join(parser, NULL);
+  pthread_join(emitter, NULL);
+  return 0;
+}
@@ -0,0 +1,11 @@
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+/* Runs the command interpreter on stdin with reading and scanning, execution, and
+ * output formatting on three threads, connected by single producer, single consumer
+ * rings of command batches and output chunks. The output is the same as that of the
+ * sequential loop in main.c. Returns the exit status */
+int run_pipelined(void);
+
+#endif /* PIPELINE_H_ */
@@ -0,0 +1,86 @@
+
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+#include "scan.h"
+
+/* Runs shorter than this are counted byte by byte; most interactive input has no runs at all */
+#define SCAN_SHORT 4
+
+/* Each implementation returns the number of bytes equal to c from q on, stopping at end */
+
+static size_t
+run_scalar(char c, const char* q, const char* end) {
+  const char* start = q;
+  while (q < end && *q == c) q++;
+  return q - start;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static size_t
+run_sse2(char c, const char* q, const char* end) {
+  const __m128i pattern = _mm_set1_epi8(c);
+  const char* start = q;
+
+  while (end - q >= 16) {
+    unsigned same = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)q), pattern));
+    if (same != 0xffff) {
+      return q - start + __builtin_ctz(~same);
+    }
+    q += 16;
+  }
+  return q - start + run_scalar(c, q, end);
+}
+
+__attribute__((target("avx2")))
+static size_t
+run_avx2(char c, const char* q, const char* end) {
+  const __m256i pattern = _mm256_set1_epi8(c);
+  const char* start = q;
+
+  while (end - q >= 32) {
+    unsigned same = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)q), pattern));
+    if (same != 0xffffffffu) {
+      return q - start + __builtin_ctz(~same);
+    }
+    q += 32;
+  }
+  return q - start + run_scalar(c, q, end);
+}
+#endif
+
+static size_t run_select(char c, const char* q, const char* end);
+
+static size_t (*run_long)(char c, const char* q, const char* end) = run_select;
+
+/* Picks the widest implementation the CPU supports on the first long run */
+static size_t
+run_select(char c, const char* q, const char* end) {
+  run_long = run_scalar;
+#ifdef SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    run_long = run_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    run_long = run_sse2;
+  }
+#endif
+  return run_long(c, q, end);
+}
+
+/* Counts short runs inline and hands longer ones to the vector loop */
+size_t
+command_run(const char* p, const char* end) {
+  size_t n = 1;
+
+  while (n < SCAN_SHORT && p + n < end && p[n] == *p) n++;
+  if (n < SCAN_SHORT) {
+    return n;
+  }
+  return n + run_long(*p, p + n, end);
+}
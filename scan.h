@@ -0,0 +1,18 @@
+
+#ifndef SCAN_H_
+#define SCAN_H_
+/**
+ * Scanner for the command stream of cmd_int. Input is compared 32 (AVX2) or 16
+ * (SSE2) bytes at a time, so that long runs of the same command can be handled
+ * as one batch. The instruction set is picked at run time; other machines use a
+ * scalar loop.
+ */
+
+#include <stddef.h>
+
+/* Returns the length of the run of bytes equal to *p that starts at p, stopping
+ * at end (p < end). A run is at least 1 */
+extern size_t
+command_run(const char* p, const char* end);
+
+#endif /* SCAN_H_ */
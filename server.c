@@ -0,0 +1,371 @@
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* You are not allowed to use <stdio.h> */
+#include "io.h"
+#include "mm.h"
+#include "scan.h"
+#include "interp.h"
+#include "server.h"
+
+/* Each session is armed in epoll with EPOLLONESHOT, so only one worker at a time
+ * handles it. The allocator is not thread safe: workers take heap_lock around
+ * everything that allocates or frees, which includes executing commands. Reading
+ * and writing the sockets happens outside the lock.
+ *
+ * Output of a session is captured with set_output_sink() into a list of blocks.
+ * Commands run in steps of at most RUN_STEP commands (one for a newline, which
+ * prints the whole collection), and once more than MAX_QUEUED bytes wait to be sent
+ * the session stops between two steps. The input it has not run yet is kept in a
+ * block of the session and run when the client has read some output (EPOLLOUT), and
+ * no more input is read until then. So a client that does not read its output makes
+ * the server queue at most MAX_QUEUED bytes plus the output of one step.
+ * The sink is also called from inside the allocator (its trace), so the blocks are
+ * mapped with mmap and recycled through free_blocks instead of using simple_malloc.
+ * At most MAX_FREE_BLOCKS are kept there, the rest are unmapped */
+
+#define MAX_THREADS   64
+#define MAX_EVENTS    16
+#define INPUT_SIZE    (64 * 1024)
+#define OUTPUT_BLOCK  (64 * 1024)
+#define MAX_QUEUED    (1024 * 1024)
+#define MAX_FREE_BLOCKS 64
+#define RUN_STEP      1024
+
+struct output_block {
+  struct output_block* next;
+  size_t len;
+  char data[OUTPUT_BLOCK];
+};
+
+struct session {
+  int fd;
+  int finished;                       // Closing lines written; close once the output is sent
+  int failed;                         // Output lost or connection broken; close now
+  Interpreter interp;
+  struct output_block* out_head;
+  struct output_block* out_tail;
+  size_t out_sent;                    // Bytes of out_head already sent
+  size_t out_queued;                  // Bytes waiting in all blocks
+  struct output_block* in_block;      // Input not run yet because the output queue is full
+  size_t in_used;                     // Bytes of in_block already run
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct output_block* free_blocks = NULL;    // Protected by heap_lock
+static size_t free_count = 0;                       // Protected by heap_lock
+static int epoll_fd;
+static int listen_fd;
+
+/* Default sink of the workers: allocator trace outside of a session is dropped */
+static void
+discard_output(void* arg, const char* p, size_t n) {
+}
+
+/* Takes a block from the free list or maps a new one (heap_lock held) */
+static struct output_block*
+get_block() {
+  struct output_block* b = free_blocks;
+
+  if (b != NULL) {
+    free_blocks = b->next;
+    free_count--;
+  } else {
+    b = mmap(NULL, sizeof(struct output_block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) return NULL;
+  }
+  b->next = NULL;
+  b->len = 0;
+  return b;
+}
+
+/* Returns a list of blocks to the free list, or unmaps them if it is full (heap_lock held) */
+static void
+put_blocks(struct output_block* b) {
+  while (b != NULL) {
+    struct output_block* next = b->next;
+    if (free_count < MAX_FREE_BLOCKS) {
+      b->next = free_blocks;
+      free_blocks = b;
+      free_count++;
+    } else {
+      munmap(b, sizeof(struct output_block));
+    }
+    b = next;
+  }
+}
+
+/* Output sink of a session while its commands run (heap_lock held) */
+static void
+capture_output(void* arg, const char* p, size_t n) {
+  struct session* s = arg;
+
+  while (n > 0 && !s->failed) {
+    struct output_block* b = s->out_tail;
+    size_t k;
+
+    if (b == NULL || b->len == OUTPUT_BLOCK) {
+      b = get_block();
+      if (b == NULL) {
+        s->failed = 1;
+        return;
+      }
+      if (s->out_tail) {
+        s->out_tail->next = b;
+      } else {
+        s->out_head = b;
+      }
+      s->out_tail = b;
+    }
+    k = OUTPUT_BLOCK - b->len;
+    if (k > n) k = n;
+    memcpy(b->data + b->len, p, k);
+    b->len += k;
+    s->out_queued += k;
+    p += k;
+    n -= k;
+  }
+}
+
+/* Runs the commands in buf (len 0 is the end of input) until more than MAX_QUEUED
+ * bytes of output are queued. Returns the number of bytes run */
+static size_t
+execute(struct session* s, const char* buf, size_t len) {
+  const char* p = buf;
+  const char* end = buf + len;
+  size_t run;
+  int running = 1;
+
+  pthread_mutex_lock(&heap_lock);
+  set_output_sink(capture_output, s);
+  for (; p < end && running && s->out_queued <= MAX_QUEUED && !s->failed; p += run) {
+    const char* limit = *p == '\n' ? p + 1 : (size_t)(end - p) > RUN_STEP ? p + RUN_STEP : end;
+    run = command_run(p, limit);
+    running = interp_run(&s->interp, *p, run);
+  }
+  if (!running || len == 0) {
+    interp_finish(&s->interp);
+    s->finished = 1;
+  }
+  set_output_sink(discard_output, NULL);
+  pthread_mutex_unlock(&heap_lock);
+  return p - buf;
+}
+
+/* Keeps the n bytes at p that execute() did not run for the next time */
+static void
+keep_input(struct session* s, const char* p, size_t n) {
+  struct output_block* b;
+
+  pthread_mutex_lock(&heap_lock);
+  b = get_block();
+  pthread_mutex_unlock(&heap_lock);
+  if (b == NULL) {
+    s->failed = 1;
+    return;
+  }
+  memcpy(b->data, p, n);
+  b->len = n;
+  s->in_block = b;
+  s->in_used = 0;
+}
+
+/* Runs more of the input kept by keep_input() and drops it once it is used up */
+static void
+resume_input(struct session* s) {
+  struct output_block* b = s->in_block;
+
+  s->in_used += execute(s, b->data + s->in_used, b->len - s->in_used);
+  if (s->in_used == b->len || s->finished) {
+    s->in_block = NULL;
+    pthread_mutex_lock(&heap_lock);
+    put_blocks(b);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+/* Sends queued output until done or the socket is full */
+static void
+send_output(struct session* s) {
+  struct output_block* done = NULL;
+
+  while (s->out_head != NULL && !s->failed) {
+    struct output_block* b = s->out_head;
+    ssize_t n = send(s->fd, b->data + s->out_sent, b->len - s->out_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) s->failed = 1;
+      break;
+    }
+    s->out_sent += n;
+    s->out_queued -= n;
+    if (s->out_sent == b->len && (b != s->out_tail || s->finished)) {
+      // Block sent; the tail stays while commands may still append to it
+      s->out_head = b->next;
+      if (s->out_head == NULL) s->out_tail = NULL;
+      s->out_sent = 0;
+      b->next = done;
+      done = b;
+    } else if (s->out_sent == b->len) {
+      s->out_sent = 0;
+      b->len = 0;
+      break;
+    }
+  }
+
+  if (done != NULL) {
+    pthread_mutex_lock(&heap_lock);
+    put_blocks(done);
+    pthread_mutex_unlock(&heap_lock);
+  }
+}
+
+static void
+close_session(struct session* s) {
+  close(s->fd);   // Also removes it from the epoll set
+  pthread_mutex_lock(&heap_lock);
+  if (!s->finished) {
+    free_collection(&s->interp.collection);
+  }
+  put_blocks(s->out_head);
+  put_blocks(s->in_block);
+  simple_free(s);
+  pthread_mutex_unlock(&heap_lock);
+}
+
+/* Handles readiness of a session and re-arms it, or closes it when it is over */
+static void
+serve(struct session* s) {
+  struct epoll_event ev;
+
+  send_output(s);
+  if (!s->finished && !s->failed && s->out_queued <= MAX_QUEUED) {
+    if (s->in_block != NULL) {
+      resume_input(s);
+      send_output(s);
+    } else {
+      char buf[INPUT_SIZE];
+      ssize_t n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+      if (n >= 0) {
+        size_t used = execute(s, buf, n);
+        if (used < (size_t)n && !s->finished) {
+          keep_input(s, buf + used, n - used);
+        }
+        send_output(s);
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        s->failed = 1;
+      }
+    }
+  }
+
+  if (s->failed || (s->finished && s->out_queued == 0)) {
+    close_session(s);
+    return;
+  }
+  // Kept input is resumed on EPOLLOUT, which comes at once if everything was sent
+  ev.events = EPOLLONESHOT | (s->out_queued > 0 || s->in_block != NULL ? EPOLLOUT : 0) |
+              (!s->finished && s->in_block == NULL && s->out_queued <= MAX_QUEUED ? EPOLLIN : 0);
+  ev.data.ptr = s;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+/* Accepts the pending connections and registers a session for each */
+static void
+accept_sessions() {
+  struct epoll_event ev;
+  int fd;
+
+  while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    struct session* s;
+
+    pthread_mutex_lock(&heap_lock);
+    s = simple_malloc(sizeof(struct session));
+    pthread_mutex_unlock(&heap_lock);
+    if (s == NULL) {
+      close(fd);
+      continue;
+    }
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close_session(s);
+    }
+  }
+
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = NULL;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, listen_fd, &ev);
+}
+
+static void*
+worker(void* arg) {
+  struct epoll_event events[MAX_EVENTS];
+
+  set_output_sink(discard_output, NULL);
+  for (;;) {
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    int i;
+
+    for (i = 0; i < n; i++) {
+      if (events[i].data.ptr == NULL) {
+        accept_sessions();
+      } else {
+        serve(events[i].data.ptr);
+      }
+    }
+  }
+  return NULL;
+}
+
+int run_server(const char* path, int threads) {
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  pthread_t pool[MAX_THREADS];
+  int i;
+
+  io_use_threads();
+  if (threads < 1) threads = 1;
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    write_fmt("Socket path too long: %s\n", path);
+    return 1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listen_fd, 128) != 0) {
+    write_fmt("Cannot listen on %s\n", path);
+    return 1;
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = NULL;   // The listening socket
+  if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0) {
+    write_fmt("Cannot set up epoll\n");
+    return 1;
+  }
+
+  write_fmt("Serving on %s with %d threads\n", path, threads);
+  flush_output();
+  for (i = 1; i < threads; i++) {
+    if (pthread_create(&pool[i], NULL, worker, NULL) != 0) break;
+  }
+  worker(NULL);
+  return 0;
+}
@@ -0,0 +1,13 @@
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/* Serves the command interpreter on a Unix domain socket at path. Every connection
+ * is a session of its own, with its own collection and counter: the client sends
+ * the usual command bytes and gets the output of cmd_int back on the socket, which
+ * is closed after the closing lines (when the client shuts down its side or sends
+ * something that is not a command). Sessions are multiplexed with epoll over a pool
+ * of worker threads of the given size. Only returns if the server cannot be started */
+int run_server(const char* path, int threads);
+
+#endif /* SERVER_H_ */
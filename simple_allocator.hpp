@@ -0,0 +1,103 @@
+
+#ifndef SIMPLE_ALLOCATOR_HPP_
+#define SIMPLE_ALLOCATOR_HPP_
+/**
+ * @file   simple_allocator.hpp
+ * @brief  Header-only C++ adapters over simple_malloc/simple_free.
+ *
+ *   simple::resource()       a std::pmr::memory_resource, for std::pmr containers
+ *   simple::SimpleAllocator  a standard allocator, for std::vector, std::unordered_map, ...
+ *
+ * Both put the container's memory in the simple heap, whatever the arena is
+ * (see memory_setup.c), and throw std::bad_alloc when it is full. Like the
+ * allocator itself they are not thread safe, except on a shared heap.
+ *
+ * Alignments up to 16 bytes, which simple_malloc gives every block in both
+ * header layouts, are served by simple_malloc, larger ones by simple_memalign. Sizes are not needed to free
+ * a block, as the heap keeps them in the block headers.
+ */
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "mm.h"
+
+namespace simple {
+
+/* Alignment simple_malloc gives every block, with compact headers and with MM_OOB_META */
+constexpr std::size_t malloc_alignment = 16;
+static_assert(malloc_alignment >= alignof(std::max_align_t), "simple_malloc must suit any type");
+
+inline void* allocate(std::size_t bytes, std::size_t alignment) {
+  void* p = alignment <= malloc_alignment ? simple_malloc(bytes) : simple_memalign(alignment, bytes);
+  if (p == nullptr) throw std::bad_alloc();
+  return p;
+}
+
+inline void deallocate(void* p) noexcept {
+  simple_free(p);
+}
+
+/* memory_resource over the simple heap. There is only one heap per process, so
+ * all instances are interchangeable and compare equal */
+class SimpleMemoryResource : public std::pmr::memory_resource {
+ protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+    return simple::allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, std::size_t, std::size_t) override {
+    simple::deallocate(p);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+    return dynamic_cast<const SimpleMemoryResource*>(&other) != nullptr;
+  }
+};
+
+/* The resource to pass to std::pmr containers, e.g.
+ *   std::pmr::vector<int> v(simple::resource()); */
+inline SimpleMemoryResource* resource() noexcept {
+  static SimpleMemoryResource instance;
+  return &instance;
+}
+
+/* Standard allocator over the simple heap, e.g.
+ *   std::vector<int, simple::SimpleAllocator<int>> v; */
+template <typename T>
+class SimpleAllocator {
+ public:
+  using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using is_always_equal = std::true_type;
+
+  SimpleAllocator() noexcept = default;
+
+  template <typename U>
+  SimpleAllocator(const SimpleAllocator<U>&) noexcept {}
+
+  T* allocate(std::size_t n) {
+    if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+    return static_cast<T*>(simple::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, std::size_t) noexcept {
+    simple::deallocate(p);
+  }
+};
+
+template <typename T, typename U>
+bool operator==(const SimpleAllocator<T>&, const SimpleAllocator<U>&) noexcept {
+  return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const SimpleAllocator<T>&, const SimpleAllocator<U>&) noexcept {
+  return false;
+}
+
+}  // namespace simple
+
+#endif /* SIMPLE_ALLOCATOR_HPP_ */
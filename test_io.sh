@@ -0,0 +1,90 @@
+#!/bin/bash
+
+# Runs cmd_int with the io_uring backend on piped and on file input, and
+# pipelined (cmd_int -p), and compares the output with that of the default
+# backend. The input starts with all commands mixed and ends with a line
+# longer than all output buffers of the ring together, written while no
+# earlier write is in flight when stdout is a file. It also checks the
+# number and format writers of io.c through io_check. Usage: ./test_io.sh
+
+app="$(pwd)/cmd_int"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+{
+  for ((i = 0; i < 2000; i++)); do
+    printf 'aaabbcc'
+    if ((i % 200 == 0)); then printf '\n'; fi
+  done
+  for ((i = 0; i < 200000; i++)); do printf 'ab'; done
+  printf 'q'
+} > "$dir/in"
+
+# Addresses differ from run to run
+normalize() {
+  sed -E 's/0x[0-9a-f]+/ADDR/g'
+}
+
+cat "$dir/in" | "$app" | normalize > "$dir/expected"
+
+status=0
+check() {
+  local name=$1
+  shift
+  if ! "$@" > "$dir/raw"; then
+    echo "FAIL: $name (exit status)"
+    status=1
+  elif ! normalize < "$dir/raw" | cmp -s "$dir/expected"; then
+    echo "FAIL: $name (output differs)"
+    status=1
+  else
+    echo "ok:   $name"
+  fi
+}
+
+uring_pipe() {
+  cat "$dir/in" | SIMPLE_IO=uring timeout 10 "$app"
+}
+
+uring_pipe_out() {
+  cat "$dir/in" | SIMPLE_IO=uring timeout 10 "$app" | cat
+}
+
+uring_file() {
+  SIMPLE_IO=uring timeout 10 "$app" < "$dir/in"
+}
+
+pipelined_pipe() {
+  cat "$dir/in" | timeout 10 "$app" -p
+}
+
+pipelined_file() {
+  timeout 10 "$app" -p < "$dir/in"
+}
+
+cat > "$dir/formatted" <<'EOF'
+-2147483648 2147483647 0
+-9223372036854775808 9223372036854775807 18446744073709551615 beef
+-9223372036854775808 -7
+-2147483648 2147483647 -1 -9223372036854775808 9223372036854775807
+4294967295 18446744073709551615 42
+abc deadbeef 0000001f 0x1234
+[   42] [-0042] [-12345] [12345]
+[abc] [     abc] [(null)] [x] [  y]
+100% [%5q] [%q] [%-3d] [%l] %
+%
+EOF
+
+if ! "$(dirname "$app")/io_check" | cmp -s - "$dir/formatted"; then
+  echo "FAIL: number and format writers (output differs)"
+  status=1
+else
+  echo "ok:   number and format writers"
+fi
+
+check "uring, piped input" uring_pipe
+check "uring, piped input and output" uring_pipe_out
+check "uring, file input" uring_file
+check "pipelined, piped input" pipelined_pipe
+check "pipelined, file input" pipelined_file
+exit $status
@@ -1,10 +1,421 @@
-
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 
 
+/* Runs this program again as "mm_test MODE" with the NAME=VALUE settings of env (up
+ * to a NULL) added to the environment, for settings that are read when the heap is
+ * set up. Collects its stderr in out and returns its wait status */
+static int run_child(const char * mode, const char * const env[], char * out, size_t cap) {
+  int fds[2];
+  size_t len = 0;
+  ssize_t n;
+  int status;
+  pid_t pid;
+
+  if (pipe(fds) != 0) return -1;
+  pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);              // The allocator traces to stdout
+    dup2(fds[1], 2);
+    close(fds[0]);
+    while (*env != NULL) putenv((char *) *env++);
+    execl("/proc/self/exe", "mm_test", mode, (char *) NULL);
+    _exit(127);
+  }
+  close(fds[1]);
+  while (len + 1 < cap && (n = read(fds[0], out + len, cap - len - 1)) > 0) len += n;
+  out[len] = '\0';
+  close(fds[0]);
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+  return status;
+}
+
+
+/* Blocks of every size suit any type, as malloc's must (the LD_PRELOAD shim hands them out as such) */
+static int test_alignment(void) {
+  void * blocks[200];
+  int i;
+  int ret = 0;
+
+  for (i = 0; i < 200; i++) {
+    blocks[i] = i % 3 == 2 ? simple_malloc_hint(i * 7, SIMPLE_LONG_LIVED) : simple_malloc(i * 7);
+    if ((uintptr_t) blocks[i] % _Alignof(max_align_t) != 0) {
+      printf("Block of %d bytes at %p is not aligned\n", i * 7, blocks[i]);
+      ret = 1;
+    }
+    if (i % 4 == 1) simple_free(blocks[i - 1]);     // Splits and merges of holes
+  }
+  for (i = 0; i < 200; i++) {
+    if (i % 4 != 0) simple_free(blocks[i]);
+  }
+  return ret;
+}
+
+/* Heap walker: the block map must agree with the block list on every block */
+static int check_block(void * ctx, void * ptr, size_t size, int flags) {
+  char * p = ptr;
+
+  if (flags & SIMPLE_BLOCK_GUARDED) return 0;
+  if (flags & SIMPLE_BLOCK_FREE) {
+    if (simple_usable_size(p) != 0 || simple_block_start(p) != NULL || simple_block_start(p + size - 1) != NULL) {
+      printf("Free block %p is in the block map\n", ptr);
+      return 1;
+    }
+  } else if (simple_usable_size(p) != size || simple_block_start(p) != p ||
+             simple_block_start(p + size / 2) != p || simple_block_start(p + size - 1) != p) {
+    printf("Block %p of %zu bytes is not in the block map\n", ptr, size);
+    return 1;
+  }
+  return 0;
+}
+
+/* Frees that are not of a block in use leave the heap alone, and the block
+ * map follows splits, merges and aligned allocations */
+static int test_block_map(void) {
+  enum { COUNT = 48 };
+  char * blocks[COUNT];
+  size_t free_bytes, largest, holes, after_bytes, after_largest, after_holes;
+  char local;
+  int i;
+
+  for (i = 0; i < COUNT; i++) blocks[i] = simple_malloc(16 + 40 * i);
+  for (i = 0; i < COUNT; i += 2) simple_free(blocks[i]);        // Holes
+  for (i = 1; i < COUNT; i += 4) simple_free(blocks[i]);        // Merging with both neighbours
+  for (i = 0; i < 6; i++) {
+    size_t alignment = (size_t) 16 << (2 * i);
+    char * p = simple_memalign(alignment, 100);
+    if (p == NULL || ((uintptr_t) p & (alignment - 1)) != 0) {
+      printf("memalign(%zu) returned %p\n", alignment, (void *) p);
+      return 1;
+    }
+    blocks[4 * i] = p;                                          // Slot of a freed block
+  }
+  if (simple_heap_walk(check_block, NULL) != 0) return 1;
+
+  // Interior, foreign and repeated frees are rejected
+  simple_free(blocks[3]);
+  simple_free_stats(&free_bytes, &largest, &holes);
+  simple_free(blocks[3]);
+  simple_free(blocks[3] + 8);
+  simple_free(blocks[7] + 8);
+  simple_free(&local);
+  simple_free_stats(&after_bytes, &after_largest, &after_holes);
+  if (after_bytes != free_bytes || after_largest != largest || after_holes != holes) {
+    printf("Invalid free changed the heap: %zu -> %zu free bytes\n", free_bytes, after_bytes);
+    return 1;
+  }
+  if (simple_usable_size(blocks[3]) != 0 || simple_usable_size(blocks[7] + 8) != 0 || simple_block_start(&local) != NULL) {
+    printf("Pointer that is no block taken for one\n");
+    return 1;
+  }
+  if (simple_heap_walk(check_block, NULL) != 0) return 1;
+
+  for (i = 0; i < COUNT; i++) {
+    if ((i % 4 == 3 && i != 3) || (i % 4 == 0 && i < 24)) simple_free(blocks[i]);
+  }
+  return simple_heap_walk(check_block, NULL);
+}
+
+/* The wilderness as a walk sees it */
+struct wilderness {
+  char * ptr;
+  size_t size;
+  int count;                    // Blocks flagged SIMPLE_BLOCK_WILDERNESS
+  int free_after;               // Free blocks after it below top
+};
+
+static int find_wilderness(void * ctx, void * ptr, size_t size, int flags) {
+  struct wilderness * w = ctx;
+
+  if (flags & SIMPLE_BLOCK_WILDERNESS) {
+    w->ptr = ptr;
+    w->size = size;
+    w->count++;
+  } else if (w->count > 0 && (flags & SIMPLE_BLOCK_FREE) && !(flags & SIMPLE_BLOCK_LONG_LIVED)) {
+    w->free_after = 1;
+  }
+  return 0;
+}
+
+/* Finds the wilderness, which must be the last free block below top */
+static int walk_wilderness(struct wilderness * w, const char * when) {
+  memset(w, 0, sizeof(*w));
+  simple_heap_walk(find_wilderness, w);
+  if (w->count != 1 || w->free_after) {
+    printf("%s: %d wilderness blocks, %s free block after it\n", when, w->count, w->free_after ? "a" : "no");
+    return 1;
+  }
+  return 0;
+}
+
+/* Short-lived requests that fit a hole leave the wilderness alone, wherever the search
+ * stands. Requests larger than every hole are cut from its start, and freeing them
+ * grows it back. It stays the last free block below top throughout */
+static int test_wilderness(void) {
+  enum { COUNT = 64 };
+  char * blocks[COUNT];
+  struct wilderness before, after;
+  char * big;
+  int i;
+
+  for (i = 0; i < COUNT; i++) blocks[i] = simple_malloc(200);
+  for (i = 0; i < COUNT; i += 2) simple_free(blocks[i]);       // Holes
+  if (walk_wilderness(&before, "With holes") != 0) return 1;
+
+  // Filled in address order, so the search ends up past all holes. Then the only hole
+  // that fits the last request is behind it
+  for (i = 0; i < COUNT; i += 2) blocks[i] = simple_malloc_hint(100 + i, SIMPLE_SHORT_LIVED);
+  simple_free(blocks[2]);
+  blocks[2] = simple_malloc_hint(150, SIMPLE_SHORT_LIVED);
+  if (walk_wilderness(&after, "After filling holes") != 0) return 1;
+  if (after.ptr != before.ptr || after.size != before.size) {
+    printf("Requests that fit a hole took %zu bytes of the wilderness\n", before.size - after.size);
+    return 1;
+  }
+
+  big = simple_malloc(4096);                                    // Larger than any hole
+  if (walk_wilderness(&after, "After a large request") != 0) return 1;
+  if (big != before.ptr || after.ptr <= big || after.size > before.size - 4096) {
+    printf("Large request at %p not cut from the wilderness at %p\n", (void *) big, (void *) before.ptr);
+    return 1;
+  }
+
+  simple_free(big);
+  if (walk_wilderness(&after, "After freeing it") != 0) return 1;
+  if (after.ptr != before.ptr || after.size != before.size) {
+    printf("Wilderness did not grow back: %zu of %zu bytes\n", after.size, before.size);
+    return 1;
+  }
+
+  for (i = 0; i < COUNT; i++) simple_free(blocks[i]);
+  return 0;
+}
+
+enum { HINTED = 200 };
+
+/* Blocks of test_hints, NULL once freed */
+struct hinted {
+  char * long_lived[HINTED];
+  char * short_lived[HINTED];
+};
+
+/* Heap walker: long-lived blocks are at or above top, short-lived ones below it */
+static int check_hint(void * ctx, void * ptr, size_t size, int flags) {
+  struct hinted * h = ctx;
+  int i;
+
+  if (flags & (SIMPLE_BLOCK_FREE | SIMPLE_BLOCK_GUARDED)) return 0;
+  for (i = 0; i < HINTED; i++) {
+    if (ptr == h->long_lived[i] && !(flags & SIMPLE_BLOCK_LONG_LIVED)) {
+      printf("Long-lived block %p is below top\n", ptr);
+      return 1;
+    }
+    if (ptr == h->short_lived[i] && (flags & SIMPLE_BLOCK_LONG_LIVED)) {
+      printf("Short-lived block %p is at or above top\n", ptr);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Walks the heap with check_hint and checks the hole bookkeeping */
+static int check_hints(struct hinted * h, const char * when) {
+  int ret = simple_heap_check();
+
+  if (ret != 0) {
+    printf("Heap check %s failed with %d\n", when, ret);
+    return 1;
+  }
+  return simple_heap_walk(check_hint, h);
+}
+
+/* Lifetime hints keep the two kinds of blocks apart, also when they reuse holes */
+static int test_hints(void) {
+  static struct hinted h;
+  int i;
+
+  for (i = 0; i < HINTED; i++) {
+    h.long_lived[i] = simple_malloc_hint(24 + 40 * (i % 7), SIMPLE_LONG_LIVED);
+    h.short_lived[i] = simple_malloc_hint(24 + 56 * (i % 5), SIMPLE_SHORT_LIVED);
+  }
+  if (check_hints(&h, "after allocating") != 0) return 1;
+
+  for (i = 0; i < HINTED; i++) {
+    if (i % 3 == 0) {
+      simple_free(h.long_lived[i]);
+      h.long_lived[i] = NULL;
+    }
+    if (i % 2 == 0) {
+      simple_free(h.short_lived[i]);
+      h.short_lived[i] = NULL;
+    }
+  }
+  if (check_hints(&h, "after making holes") != 0) return 1;
+
+  for (i = 0; i < HINTED; i++) {
+    if (h.long_lived[i] == NULL) h.long_lived[i] = simple_malloc_hint(24 + 40 * (i % 4), SIMPLE_LONG_LIVED);
+    if (h.short_lived[i] == NULL) h.short_lived[i] = simple_malloc_hint(24 + 56 * (i % 3), SIMPLE_SHORT_LIVED);
+  }
+  if (check_hints(&h, "after reusing holes") != 0) return 1;
+
+  for (i = 0; i < HINTED; i += 2) {
+    simple_free(h.long_lived[i]);
+    simple_free(h.short_lived[i + 1]);
+    h.long_lived[i] = h.short_lived[i + 1] = NULL;
+  }
+  if (check_hints(&h, "after freeing half") != 0) return 1;
+
+  for (i = 0; i < HINTED; i++) {
+    simple_free(h.long_lived[i]);
+    simple_free(h.short_lived[i]);
+  }
+  return simple_heap_check() != 0;
+}
+
+/* Records of a heap map, compared with a walk by check_record */
+struct map_records {
+  const SimpleHeapMapBlock * record;
+  size_t count;
+  size_t seen;
+};
+
+static int check_record(void * ctx, void * ptr, size_t size, int flags) {
+  struct map_records * m = ctx;
+  const SimpleHeapMapBlock * r = m->record + m->seen;
+
+  if (flags & SIMPLE_BLOCK_GUARDED) return 0;   // Outside the arena, not in the map
+  if (m->seen == m->count) {
+    printf("Heap map has %zu blocks, the walk more\n", m->count);
+    return 1;
+  }
+  if (r->offset != (uintptr_t) ptr - memory_start || r->size != size || r->flags != (uint32_t) flags) {
+    printf("Heap map block %zu is %u+%u/%u, the walk found %zu+%zu/%d\n",
+           m->seen, r->offset, r->size, r->flags, (size_t) ((uintptr_t) ptr - memory_start), size, flags);
+    return 1;
+  }
+  m->seen++;
+  return 0;
+}
+
+/* Writes a heap map to a temporary file and reads it back. Returns its records (from
+ * malloc), or NULL if it cannot be read or the header does not fit the file */
+static SimpleHeapMapBlock * read_back_heap_map(SimpleHeapMapHeader * header) {
+  char path[] = "/tmp/mm_test_map.XXXXXX";
+  SimpleHeapMapBlock * records = NULL;
+  struct stat st;
+  size_t len;
+  int fd = mkstemp(path);
+
+  memset(header, 0, sizeof(*header));
+  if (fd < 0) return NULL;
+  unlink(path);
+  if (simple_heap_map_write(fd) == 0 && fstat(fd, &st) == 0 && lseek(fd, 0, SEEK_SET) == 0 &&
+      read(fd, header, sizeof(*header)) == sizeof(*header) && header->magic == SIMPLE_HEAP_MAP_MAGIC &&
+      (size_t) st.st_size == sizeof(*header) + header->blocks * sizeof(SimpleHeapMapBlock)) {
+    len = st.st_size - sizeof(*header);
+    records = malloc(len + 1);
+    if (records != NULL && read(fd, records, len) != (ssize_t) len) {
+      free(records);
+      records = NULL;
+    }
+  }
+  close(fd);
+  return records;
+}
+
+/* A heap map written to a file reads back as the blocks of a walk */
+static int test_heap_map(void) {
+  char * blocks[32];
+  SimpleHeapMapHeader header;
+  SimpleHeapMapBlock * records;
+  struct map_records m;
+  int ret = 1;
+  int i;
+
+  for (i = 0; i < 32; i++) {
+    blocks[i] = i % 4 == 3 ? simple_malloc_hint(40 + 24 * i, SIMPLE_LONG_LIVED) : simple_malloc(40 + 24 * i);
+  }
+  for (i = 0; i < 32; i += 3) simple_free(blocks[i]);           // Holes in both regions
+
+  records = read_back_heap_map(&header);
+  if (records == NULL || header.arena_size != memory_end - memory_start) {
+    printf("Heap map not read back: magic %llx, %llu blocks\n",
+           (unsigned long long) header.magic, (unsigned long long) header.blocks);
+  } else {
+    m.record = records;
+    m.count = header.blocks;
+    m.seen = 0;
+    ret = simple_heap_walk(check_record, &m);
+    if (ret == 0 && m.seen != m.count) {
+      printf("Heap map has %zu blocks, the walk %zu\n", m.count, m.seen);
+      ret = 1;
+    }
+  }
+
+  free(records);
+  for (i = 0; i < 32; i++) {
+    if (i % 3 != 0) simple_free(blocks[i]);
+  }
+  return ret != 0;
+}
+
+/* Child side of the guard page tests, run with SIMPLE_GUARD_SAMPLE=1 so that every block is guarded */
+static int guard_child(const char * mode) {
+  char * p = simple_malloc(24);
+  size_t size = simple_usable_size(p);
+
+  // Only the start of a live block is one
+  if (size < 24 || simple_usable_size(p + 8) != 0 || simple_block_start(p + 8) != p) {
+    fprintf(stderr, "guarded block not validated\n");
+    return 2;
+  }
+  if (strcmp(mode, "guard-overflow") == 0) {
+    ((volatile char *) p)[size] = 1;
+  } else {
+    simple_free(p);
+    if (simple_usable_size(p) != 0 || simple_block_start(p) != NULL) {
+      fprintf(stderr, "freed guarded block still valid\n");
+      return 2;
+    }
+    (void) ((volatile char *) p)[0];
+  }
+  return 0;                     // Not reached: the access faults
+}
+
+/* A sampled overflow and a use after free kill the process with a report */
+static int test_guard_report(void) {
+  static const char * cases[][2] = {
+    { "guard-overflow", "buffer overflow" },
+    { "guard-use-after-free", "use after free" },
+  };
+  char out[2048];
+  size_t i;
+
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    static const char * const env[] = { "SIMPLE_GUARD_SAMPLE=1", NULL };
+    int status = run_child(cases[i][0], env, out, sizeof(out));
+
+    if (status == -1 || !WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV || strstr(out, cases[i][1]) == NULL) {
+      printf("%s was not reported: %s\n", cases[i][0], out);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
 /** 
  * Test program that makes some simple allocations and enables
  * you to inspect the result.
@@ -12,8 +423,124 @@
  * Elaborate on your own.
  */
 
+/* Allocates and frees count blocks of assorted sizes, at most 16 at a time */
+static void churn(int count) {
+  char * live[16] = { NULL };
+  int i;
+
+  for (i = 0; i < count; i++) {
+    simple_free(live[i % 16]);
+    live[i % 16] = simple_malloc(1 + (i * 37) % 300);
+  }
+  for (i = 0; i < 16; i++) simple_free(live[i]);
+}
+
+/* Child side of the shared heap test, run with SIMPLE_ARENA=shm: a process forked
+ * off frees a block of its parent and hands over one of its own as the root, while
+ * both allocate from the heap at the same time */
+static int shm_child(void) {
+  size_t free_bytes, largest, holes, after_bytes, after_largest, after_holes;
+  char * p;
+  char * q;
+  int status;
+  pid_t pid;
+
+  simple_free(simple_malloc(1));
+  simple_free_stats(&free_bytes, &largest, &holes);             // The empty heap
+  p = simple_malloc(100);
+
+  pid = fork();
+  if (pid == 0) {
+    q = simple_malloc(200);
+    strcpy(q, "allocated by the child");
+    simple_free(p);
+    simple_set_root(q);
+    churn(20000);
+    _exit(0);
+  }
+  churn(20000);
+  if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "shared heap child failed\n");
+    return 1;
+  }
+
+  q = simple_get_root();
+  if (simple_usable_size(p) != 0 || q == NULL || simple_usable_size(q) < 200 || strcmp(q, "allocated by the child") != 0) {
+    fprintf(stderr, "blocks of the child not seen by the parent\n");
+    return 1;
+  }
+  simple_free(q);
+  simple_free_stats(&after_bytes, &after_largest, &after_holes);
+  if (after_bytes != free_bytes || after_largest != largest || after_holes != holes) {
+    fprintf(stderr, "shared heap not empty again: %zu of %zu bytes free in %zu blocks\n", after_bytes, free_bytes, after_holes);
+    return 1;
+  }
+  return 0;
+}
+
+/* Child side of the heap file test. file-create leaves a root behind, and each
+ * file-reopen finds it and replaces it, exiting without a sync so that the next
+ * one has to rebuild the state from the blocks */
+static int file_child(const char * mode) {
+  static const char text[] = "root of the heap file";
+  char * root = simple_get_root();
+  char * next;
+
+  if (strcmp(mode, "file-reopen") == 0 &&
+      (root == NULL || strcmp(root, text) != 0 || simple_usable_size(root) < sizeof(text) || simple_block_start(root + 5) != root)) {
+    fprintf(stderr, "root of the heap file lost\n");
+    return 1;
+  }
+  next = simple_malloc(sizeof(text));
+  churn(1000);
+  strcpy(next, text);
+  simple_free(root);
+  simple_set_root(next);
+  if (strcmp(mode, "file-reopen") == 0) _exit(0);
+  return 0;                     // Synced at exit
+}
+
+/* A shared heap works across processes, and a heap file keeps its root */
+static int test_shared_heaps(void) {
+  static const char * const shm_env[] = { "SIMPLE_ARENA=shm", NULL };
+  char heap_env[64];
+  const char * file_env[] = { "SIMPLE_ARENA=file", heap_env, NULL };
+  char path[] = "/tmp/mm_test.XXXXXX";
+  const char * modes[] = { "file-create", "file-reopen", "file-reopen" };
+  char out[2048];
+  int status;
+  size_t i;
+  int fd;
+
+  status = run_child("shm", shm_env, out, sizeof(out));
+  if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("Shared heap test failed: %s\n", out);
+    return 1;
+  }
+
+  fd = mkstemp(path);           // An empty file becomes a new heap
+  if (fd < 0) return 1;
+  close(fd);
+  snprintf(heap_env, sizeof(heap_env), "SIMPLE_HEAP=%s", path);
+  for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    status = run_child(modes[i], file_env, out, sizeof(out));
+    if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      printf("Heap file test failed in %s: %s\n", modes[i], out);
+      unlink(path);
+      return 1;
+    }
+  }
+  unlink(path);
+  return 0;
+}
+
+
 int main(int argc, char ** argv) {
 
+  if (argc > 1 && strncmp(argv[1], "guard-", 6) == 0) return guard_child(argv[1]);
+  if (argc > 1 && strcmp(argv[1], "shm") == 0) return shm_child();
+  if (argc > 1 && strncmp(argv[1], "file-", 5) == 0) return file_child(argv[1]);
+
   /* Ensure that macros are working */
   int ret = simple_macro_test();
   if (ret > 0) {
@@ -21,6 +548,22 @@ int main(int argc, char ** argv) {
     return 1;
   }
 
+  /* Requests larger than the heap fail rather than wrap around to a small block */
+  if (simple_malloc(SIZE_MAX) != NULL || simple_malloc(SIZE_MAX - 3) != NULL ||
+      simple_malloc_hint(SIZE_MAX, SIMPLE_LONG_LIVED) != NULL || simple_memalign(64, SIZE_MAX) != NULL) {
+    printf("Huge allocation did not fail\n");
+    return 1;
+  }
+
+  if (test_alignment() != 0) return 1;
+
+  if (test_block_map() != 0) return 1;
+  if (test_wilderness() != 0) return 1;
+  if (test_hints() != 0) return 1;
+  if (test_heap_map() != 0) return 1;
+  if (test_guard_report() != 0) return 1;
+  if (test_shared_heaps() != 0) return 1;
+
   void * a = simple_malloc(0x200);
 
   void * b = simple_malloc(0x100);
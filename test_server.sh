@@ -0,0 +1,47 @@
+#!/bin/bash
+
+# Runs cmd_int as a server (cmd_int -s) against cmd_load: first several clients
+# that read their output at full speed, then one slow reader whose session
+# produces about 20 MB of output. The server must stop running commands while
+# its output queue is full, so its peak RSS has to stay far below the size of
+# that output. Usage: ./test_server.sh
+
+app="$(pwd)/cmd_int"
+load="$(pwd)/cmd_load"
+dir=$(mktemp -d)
+sock="$dir/sock"
+max_rss_kb=8192
+
+"$app" -s "$sock" 2 > /dev/null &
+server=$!
+trap 'kill $server 2> /dev/null; rm -rf "$dir"' EXIT
+
+for ((i = 0; i < 50; i++)); do
+  [ -S "$sock" ] && break
+  sleep 0.1
+done
+
+status=0
+check() {
+  local name=$1
+  shift
+  if ! timeout 60 "$@" > "$dir/out"; then
+    echo "FAIL: $name"
+    cat "$dir/out"
+    status=1
+  else
+    echo "ok:   $name"
+  fi
+}
+
+check "fast readers" "$load" "$sock" 4 20 1000
+check "slow reader" "$load" "$sock" 1 1 20000 1 1
+
+rss=$(awk '/^VmHWM:/ { print $2 }' /proc/$server/status)
+if [ -z "$rss" ] || [ "$rss" -gt $max_rss_kb ]; then
+  echo "FAIL: server peak RSS ${rss:-unknown} kB, limit $max_rss_kb kB"
+  status=1
+else
+  echo "ok:   server peak RSS $rss kB"
+fi
+exit $status
@@ -0,0 +1,335 @@
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "io.h"
+#include "uring.h"
+
+/* liburing is not required; the ring is driven with the raw system calls */
+
+#define URING_ENTRIES       16
+#define URING_READ_BUFFERS  4
+#define URING_WRITE_BUFFERS 4
+
+#define TAG_WRITE 0x100         // user_data of writes; reads carry their buffer index
+
+static int ring_fd = -1;
+static unsigned* sq_head;
+static unsigned* sq_tail;
+static unsigned* sq_entries;
+static unsigned* sq_mask;
+static unsigned* sq_array;
+static struct io_uring_sqe* sqes;
+static unsigned* cq_head;
+static unsigned* cq_tail;
+static unsigned* cq_mask;
+static struct io_uring_cqe* cqes;
+static int in_flight = 0;       // Requests submitted and not yet reaped
+
+/* Input: a ring of buffers. The queued ones, oldest first, are being read or hold
+ * data that has not been handed out yet. Regular files are read at explicit offsets
+ * with all buffers in flight. io.c maps regular files instead, so this only happens
+ * if mmap fails. Pipes and terminals are read one read at a time, ahead of the
+ * reader. Reads at the current position that are in flight together can complete
+ * in any order, and linking them does not help: a short read, which is the usual
+ * read of a pipe, cancels the reads linked after it */
+struct read_buffer {
+  char data[IO_INPUT_BUFFER_SIZE];
+  int done;                     // Completed, result is valid
+  int result;                   // Bytes read or -errno
+  off_t offset;                 // File offset, -1 for the current position
+};
+
+static struct read_buffer read_buffers[URING_READ_BUFFERS];
+static int read_head = 0;       // Oldest queued buffer
+static int read_queued = 0;
+static int read_held = 0;       // A buffer is handed out (the one before read_head)
+static int read_seekable = 0;
+static off_t read_offset;       // Offset of the next read if read_seekable
+
+/* Output: a FIFO of buffers. Only the head is in flight, which keeps the writes in order */
+struct write_buffer {
+  char data[IO_OUTPUT_BUFFER_SIZE];
+  size_t start;                 // Already written
+  size_t len;                   // Still to write
+};
+
+static struct write_buffer write_buffers[URING_WRITE_BUFFERS];
+static int write_head = 0;
+static int write_count = 0;
+static int write_in_flight = 0;
+static int write_failed = 0;
+
+/* Maps the submission and completion rings described by p. On failure nothing stays mapped */
+static int
+map_rings(struct io_uring_params* p) {
+  size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+  size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  char* sq;
+  char* cq;
+
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+  }
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return -1;
+  cq = sq;
+  if (!(p->features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) {
+      munmap(sq, sq_size);
+      return -1;
+    }
+  }
+  sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    if (cq != sq) munmap(cq, cq_size);
+    munmap(sq, sq_size);
+    return -1;
+  }
+
+  sq_head = (unsigned*)(sq + p->sq_off.head);
+  sq_tail = (unsigned*)(sq + p->sq_off.tail);
+  sq_entries = (unsigned*)(sq + p->sq_off.ring_entries);
+  sq_mask = (unsigned*)(sq + p->sq_off.ring_mask);
+  sq_array = (unsigned*)(sq + p->sq_off.array);
+  cq_head = (unsigned*)(cq + p->cq_off.head);
+  cq_tail = (unsigned*)(cq + p->cq_off.tail);
+  cq_mask = (unsigned*)(cq + p->cq_off.ring_mask);
+  cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+  return 0;
+}
+
+/* Sets up the ring. Needs IORING_FEAT_RW_CUR_POS (Linux 5.6) to read and write pipes */
+int
+uring_setup(void) {
+  struct io_uring_params params;
+  struct stat st;
+
+  memset(&params, 0, sizeof(params));
+  ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (ring_fd < 0) {
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_RW_CUR_POS) || map_rings(&params) != 0) {
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+  }
+
+  if (fstat(0, &st) == 0 && S_ISREG(st.st_mode)) {
+    read_offset = lseek(0, 0, SEEK_CUR);
+    read_seekable = read_offset >= 0;
+  }
+  return 0;
+}
+
+/* Submits one request. Only one thread uses the ring, so the tail needs no locking.
+ * Returns 0, or -1 if the request was not submitted */
+static int
+submit(int op, int fd, const void* addr, size_t len, off_t offset, unsigned long tag) {
+  unsigned tail = *sq_tail;
+  unsigned index = tail & *sq_mask;
+  struct io_uring_sqe* sqe = &sqes[index];
+  int ret;
+
+  if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= *sq_entries) {
+    return -1;                  // No room in the submission ring
+  }
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)addr;
+  sqe->len = len;
+  sqe->off = offset;
+  sqe->user_data = tag;
+  sq_array[index] = index;
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+  do {
+    ret = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret != 1 && __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == tail) {
+    // Not taken by the kernel. Without SQPOLL it only looks at the ring during
+    // io_uring_enter, so the entry can be withdrawn and never completes
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+    return -1;
+  }
+  in_flight++;
+  return 0;
+}
+
+/* Starts writing the head of the output FIFO unless a write is in flight */
+static void
+submit_write() {
+  struct write_buffer* w = &write_buffers[write_head];
+
+  if (write_in_flight || write_count == 0) return;
+  if (submit(IORING_OP_WRITE, 1, w->data + w->start, w->len, -1, TAG_WRITE) != 0) {
+    write_failed = 1;           // Drop the queued output rather than block forever
+    write_count = 0;
+    return;
+  }
+  write_in_flight = 1;
+}
+
+static void
+complete_write(int result) {
+  struct write_buffer* w = &write_buffers[write_head];
+
+  write_in_flight = 0;
+  if (result <= 0 && result != -EINTR && result != -EAGAIN) {
+    write_failed = 1;
+    w->len = 0;
+  } else if (result > 0) {
+    w->start += result;
+    w->len -= result;
+  }
+  if (w->len == 0) {
+    write_head = (write_head + 1) % URING_WRITE_BUFFERS;
+    write_count--;
+  }
+  submit_write();               // The next buffer, or the rest of a short write
+}
+
+/* Processes the completions that are available. If wait, waits for at least one first.
+ * Returns 0, or -1 if waiting failed or there is nothing in flight to wait for */
+static int
+reap(int wait) {
+  for (;;) {
+    unsigned head = *cq_head;
+    struct io_uring_cqe* cqe;
+
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      if (!wait) return 0;
+      if (in_flight == 0) return -1;
+      if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        return -1;
+      }
+      continue;
+    }
+    cqe = &cqes[head & *cq_mask];
+    if (cqe->user_data == TAG_WRITE) {
+      complete_write(cqe->res);
+    } else {
+      read_buffers[cqe->user_data].result = cqe->res;
+      read_buffers[cqe->user_data].done = 1;
+    }
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    in_flight--;
+    wait = 0;
+  }
+}
+
+/* Queues reads into the free buffers: all of them for a regular file, one otherwise */
+static void
+read_ahead() {
+  int limit = read_seekable ? URING_READ_BUFFERS - read_held : 1;
+
+  while (read_queued < limit) {
+    int i = (read_head + read_queued) % URING_READ_BUFFERS;
+    struct read_buffer* r = &read_buffers[i];
+
+    r->done = 0;
+    r->offset = read_seekable ? read_offset : -1;
+    if (submit(IORING_OP_READ, 0, r->data, sizeof(r->data), r->offset, i) != 0) return;
+    if (read_seekable) read_offset += sizeof(r->data);
+    read_queued++;
+  }
+}
+
+/* Waits for the oldest queued read and takes it off the queue. Returns its buffer */
+static struct read_buffer*
+next_read() {
+  struct read_buffer* r = &read_buffers[read_head];
+
+  while (!r->done) {
+    if (reap(1) != 0) {
+      r->result = -EIO;         // Cannot wait; the read is abandoned with its buffer
+      break;
+    }
+  }
+  read_head = (read_head + 1) % URING_READ_BUFFERS;
+  read_queued--;
+  return r;
+}
+
+/* Hands out the next block of stdin and keeps the reads after it in flight */
+size_t
+uring_read(const char** data) {
+  struct read_buffer* r;
+
+  read_held = 0;
+  read_ahead();
+  if (read_queued == 0) {
+    return 0;
+  }
+  r = next_read();
+
+  if (r->result <= 0 || (read_seekable && (size_t)r->result < sizeof(r->data))) {
+    // End of input, an error or a short read: the reads queued after this one are
+    // of no use. Restart after the data actually read on the next call
+    while (read_queued > 0) next_read();
+    read_head = (r - read_buffers + 1) % URING_READ_BUFFERS;
+    if (read_seekable) read_offset = r->offset + (r->result > 0 ? r->result : 0);
+    if (r->result <= 0) return 0;
+  }
+
+  read_held = 1;
+  read_ahead();
+  *data = r->data;
+  return r->result;
+}
+
+/* Appends to the last queued buffer unless it is being written, starting new buffers as needed */
+int
+uring_write(const char* p, size_t n) {
+  reap(0);
+  while (n > 0) {
+    int tail = (write_head + write_count - 1 + URING_WRITE_BUFFERS) % URING_WRITE_BUFFERS;
+    struct write_buffer* w = &write_buffers[tail];
+    size_t room;
+    size_t k;
+
+    if (write_count == 0 || (write_in_flight && write_count == 1) ||
+        w->start + w->len == sizeof(w->data)) {
+      if (write_count == URING_WRITE_BUFFERS) {
+        // All buffers are full: start writing the head if it is not yet, and wait for room
+        submit_write();
+        if (write_count == URING_WRITE_BUFFERS && reap(1) != 0) return EOF;
+        continue;
+      }
+      tail = (write_head + write_count) % URING_WRITE_BUFFERS;
+      w = &write_buffers[tail];
+      w->start = 0;
+      w->len = 0;
+      write_count++;
+    }
+    room = sizeof(w->data) - w->start - w->len;
+    k = n < room ? n : room;
+    memcpy(w->data + w->start + w->len, p, k);
+    w->len += k;
+    p += k;
+    n -= k;
+  }
+  submit_write();
+  return write_failed ? EOF : 0;
+}
+
+/* Waits for the output FIFO to empty */
+int
+uring_drain(void) {
+  submit_write();
+  while (write_count > 0) {
+    if (reap(1) != 0) return EOF;
+  }
+  return write_failed ? EOF : 0;
+}
@@ -0,0 +1,35 @@
+
+#ifndef URING_H_
+#define URING_H_
+/**
+ * io_uring backend for io.c. Keeps several blocks of stdin read ahead and
+ * writes stdout in the background, so that I/O overlaps with the work of the
+ * program. Selected at run time with SIMPLE_IO=uring; io.c falls back to
+ * read(2)/write(2) if the ring cannot be set up.
+ */
+
+#include <stddef.h>
+
+/* Sets up a ring for stdin and stdout.  Returns 0, or -1 if io_uring is not
+ * available (old kernel, disabled by seccomp, ...) */
+extern int
+uring_setup(void);
+
+/* Waits for the next block of stdin and makes it available at *data. The block
+ * handed out by the previous call is reused for read-ahead, so it must no longer
+ * be in use.  Returns its length, or 0 at end of input or on a read error */
+extern size_t
+uring_read(const char ** data);
+
+/* Copies n bytes at p into the output queue and returns without waiting for the
+ * write.  If no errors occur, it returns 0, otherwise EOF (also for errors of
+ * earlier queued writes) */
+extern int
+uring_write(const char * p, size_t n);
+
+/* Waits until all queued output has been written.  If no errors occur, it
+ * returns 0, otherwise EOF */
+extern int
+uring_drain(void);
+
+#endif /* URING_H_ */